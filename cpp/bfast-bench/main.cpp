@@ -0,0 +1,518 @@
+/*
+    BFAST Benchmarks
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Measures the throughput of the BFAST writers and readers on synthetic sets of arrays: many tiny arrays, a few
+    huge ones, and a mix of sizes. Each run reports GB/s of array data, the I/O calls made, page faults, and peak
+    memory. The results are written as JSON, and can be compared against the results of an earlier build to catch
+    regressions between releases.
+*/
+#include <ara3d/bfast/bfast_async.h>
+#include <ara3d/bfast/bfast_view.h>
+#include <ara3d/bfast/bfast_writer.h>
+#include <nlohmann/json.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace bfast;
+using json = nlohmann::json;
+
+// Counters of the whole process, sampled before and after each run. Counters the OS does not provide are left negative.
+struct ProcessCounters
+{
+    double syscalls = -1;
+    double page_faults = -1;
+    double rss = -1;
+    double peak_rss = -1;
+};
+
+// True if the peak memory of the process can be reset, so that it can be measured for each run on its own
+#ifdef __linux__
+static const bool peak_rss_per_run = true;
+#else
+static const bool peak_rss_per_run = false;
+#endif
+
+// Looks up a "name: value" line, as found in /proc/self/io and /proc/self/status
+static bool read_proc_value(const string& path, const string& name, double& value) {
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        if (line.compare(0, name.size(), name) == 0 && line.size() > name.size() && line[name.size()] == ':') {
+            value = stod(line.substr(name.size() + 1));
+            return true;
+        }
+    }
+    return false;
+}
+
+static void reset_peak_rss() {
+#ifdef __linux__
+    // Writing 5 resets the peak resident set size of the process to its current size
+    ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+static ProcessCounters sample_counters() {
+    ProcessCounters c;
+#ifdef _WIN32
+    IO_COUNTERS io;
+    if (GetProcessIoCounters(GetCurrentProcess(), &io))
+        c.syscalls = (double)(io.ReadOperationCount + io.WriteOperationCount + io.OtherOperationCount);
+    PROCESS_MEMORY_COUNTERS memory;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+        c.page_faults = memory.PageFaultCount;
+        c.rss = (double)memory.WorkingSetSize;
+        c.peak_rss = (double)memory.PeakWorkingSetSize;
+    }
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        c.page_faults = (double)(usage.ru_minflt + usage.ru_majflt);
+#ifdef __APPLE__
+        c.peak_rss = (double)usage.ru_maxrss;
+#else
+        c.peak_rss = (double)usage.ru_maxrss * 1024;
+#endif
+    }
+#ifdef __linux__
+    // The read and write calls of all kinds, including positional and vectored ones
+    double reads, writes;
+    if (read_proc_value("/proc/self/io", "syscr", reads) && read_proc_value("/proc/self/io", "syscw", writes))
+        c.syscalls = reads + writes;
+    double kb;
+    if (read_proc_value("/proc/self/status", "VmRSS", kb)) c.rss = kb * 1024;
+    if (read_proc_value("/proc/self/status", "VmHWM", kb)) c.peak_rss = kb * 1024;
+#endif
+#endif
+    return c;
+}
+
+// Drops a file from the page cache so that the next read comes from the disk. Returns false if that is not possible.
+static bool evict_from_cache(const string& path) {
+#ifdef __linux__
+    File f(path, file_read);
+    ::fdatasync(f._fd);
+    return posix_fadvise(f._fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+#else
+    return false;
+#endif
+}
+
+// Touches every cache line of an array so that readers which map or defer the data still pay for bringing it in
+static volatile ulong sink;
+static void consume(ByteRange r) {
+    ulong sum = 0;
+    for (auto p = r.begin(); p < r.end(); p += 64)
+        sum += *p;
+    sink = sink + sum;
+}
+
+// A set of arrays to write and read, filled with pseudo-random bytes
+struct Workload
+{
+    string name;
+    Bfast bfast;
+
+    explicit Workload(const string& name) : name(name) { }
+
+    ulong bytes() const {
+        ulong r = 0;
+        for (auto range : bfast.ranges) r += range.size();
+        return r;
+    }
+};
+
+// A small xorshift generator, so that the data is the same on every platform and every run
+struct Random
+{
+    ulong state;
+    explicit Random(ulong seed) : state(seed) { }
+    ulong next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    // A value between lo and hi inclusive, evenly spread on a log scale
+    size_t log_uniform(size_t lo, size_t hi) {
+        auto t = (double)(next() >> 11) / (double)(1ull << 53);
+        return (size_t)exp(log((double)lo) + t * (log((double)hi) - log((double)lo)));
+    }
+};
+
+static void add_arrays(Workload& w, const vector<size_t>& sizes, Random& random) {
+    for (auto size : sizes) {
+        auto p = w.bfast.allocate_array(size);
+        for (size_t i = 0; i < size; i += sizeof(ulong)) {
+            auto x = random.next();
+            memcpy(p + i, &x, min(sizeof(x), size - i));
+        }
+    }
+}
+
+// At a scale of 1: 200,000 arrays of up to 256 bytes (about 25 MB), 4 arrays of 64 MB, and 1,000 arrays of 16 bytes
+// to 1 MB spread on a log scale (about 95 MB)
+static vector<unique_ptr<Workload>> make_workloads(double scale) {
+    vector<unique_ptr<Workload>> r;
+    Random random(0x9E3779B97F4A7C15ull);
+
+    r.emplace_back(new Workload("tiny"));
+    vector<size_t> sizes((size_t)max(1.0, 200000 * scale));
+    for (auto& size : sizes) size = 1 + random.next() % 256;
+    add_arrays(*r.back(), sizes, random);
+
+    r.emplace_back(new Workload("huge"));
+    sizes.assign(4, (size_t)max(1.0, (64 << 20) * scale));
+    add_arrays(*r.back(), sizes, random);
+
+    r.emplace_back(new Workload("mixed"));
+    sizes.resize((size_t)max(1.0, 1000 * scale));
+    for (auto& size : sizes) size = random.log_uniform(16, 1 << 20);
+    add_arrays(*r.back(), sizes, random);
+    return r;
+}
+
+// An operation to time. Before runs first and is not timed.
+struct Benchmark
+{
+    string name;
+    string kind;
+    function<void()> run;
+    function<void()> before;
+};
+
+struct Options
+{
+    string dir = ".";
+    string out;
+    string baseline;
+    string only;
+    double scale = 1;
+    double tolerance = 0.1;
+    size_t repeat = 3;
+    bool cold = false;
+};
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static double median(vector<double> values) {
+    sort(values.begin(), values.end());
+    auto n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// A counter in the JSON output, or null if the OS does not provide it
+static json counter(double value) {
+    return value < 0 ? json() : json(value);
+}
+
+// The calls and faults counted by sampling the counters twice with nothing in between, such as the reads of /proc
+static ProcessCounters measure_overhead() {
+    ProcessCounters r;
+    auto c0 = sample_counters();
+    auto c1 = sample_counters();
+    r.syscalls = c1.syscalls - c0.syscalls;
+    r.page_faults = c1.page_faults - c0.page_faults;
+    return r;
+}
+
+static json run_benchmark(const Workload& w, const Benchmark& b, const string& path, const Options& options) {
+    static const auto overhead = measure_overhead();
+    vector<double> seconds;
+    double syscalls = 0, page_faults = 0, peak_rss = -1, added_rss = -1;
+    for (size_t i = 0; i < options.repeat; ++i) {
+        if (b.before) b.before();
+        reset_peak_rss();
+        auto c0 = sample_counters();
+        auto start = chrono::steady_clock::now();
+        b.run();
+        seconds.push_back(seconds_since(start));
+        auto c1 = sample_counters();
+        syscalls = c0.syscalls < 0 || syscalls < 0 ? -1 : syscalls + max(0.0, c1.syscalls - c0.syscalls - overhead.syscalls);
+        page_faults = c0.page_faults < 0 || page_faults < 0 ? -1 : page_faults + max(0.0, c1.page_faults - c0.page_faults - overhead.page_faults);
+        peak_rss = max(peak_rss, c1.peak_rss);
+        if (peak_rss_per_run && c0.rss >= 0 && c1.peak_rss >= 0)
+            added_rss = max(added_rss, c1.peak_rss - c0.rss);
+    }
+
+    ulong file_bytes = 0;
+    try { file_bytes = File(path, file_read).size(); }
+    catch (const runtime_error&) { }
+
+    // Counters are averaged over the runs
+    auto per_run = [&](double total) { return total < 0 ? -1 : total / options.repeat; };
+    auto bytes = (double)w.bytes();
+    auto best = *min_element(seconds.begin(), seconds.end());
+    auto middle = median(seconds);
+    json r = {
+        { "workload", w.name },
+        { "benchmark", b.name },
+        { "kind", b.kind },
+        { "arrays", w.bfast.ranges.size() },
+        { "bytes", w.bytes() },
+        { "file_bytes", file_bytes },
+        { "seconds", seconds },
+        { "seconds_best", best },
+        { "seconds_median", middle },
+        { "gbps_best", bytes / max(best, 1e-9) / 1e9 },
+        { "gbps_median", bytes / max(middle, 1e-9) / 1e9 },
+        { "syscalls", counter(per_run(syscalls)) },
+        { "page_faults", counter(per_run(page_faults)) },
+        { "peak_rss", counter(peak_rss) },
+        { "added_rss", counter(added_rss) },
+    };
+    return r;
+}
+
+static vector<Benchmark> make_write_benchmarks(const Workload& w, const string& path) {
+    auto& b = w.bfast;
+    auto remove_output = [path]() { std::remove(path.c_str()); };
+    vector<Benchmark> r;
+    r.push_back({ "copy_to_bytes", "write", [&b]() {
+        auto bytes = b.copy_to_bytes();
+        sink = sink + bytes.size();
+    }, nullptr });
+    r.push_back({ "copy_to_stream", "write", [&b, path]() {
+        ofstream out(path, ofstream::out | ofstream::binary);
+        b.copy_to_stream(out);
+        if (!out) throw runtime_error("Failed to write file: " + path);
+    }, remove_output });
+    r.push_back({ "write_file", "write", [&b, path]() { write_file(b, path); }, remove_output });
+    r.push_back({ "write_file_checksums", "write", [&b, path]() {
+        WriteOptions options;
+        options.checksums = true;
+        write_file(b, path, options);
+    }, remove_output });
+    r.push_back({ "write_file_direct", "write", [&b, path]() { write_file_direct(b, path); }, remove_output });
+    r.push_back({ "write_file_parallel", "write", [&b, path]() { write_file_parallel(b, path); }, remove_output });
+    r.push_back({ "streaming_writer", "write", [&b, path]() {
+        StreamingWriter writer(path, b.ranges.size());
+        for (auto range : b.ranges)
+            writer.add_array(range.begin(), range.end());
+        writer.close();
+    }, remove_output });
+    return r;
+}
+
+static vector<Benchmark> make_read_benchmarks(const Workload& w, const string& path, bool cold) {
+    auto n = w.bfast.ranges.size();
+    auto before = [path, cold]() {
+        if (cold && !evict_from_cache(path))
+            throw runtime_error("Files can not be evicted from the page cache on this platform");
+    };
+    vector<Benchmark> r;
+    r.push_back({ "mapped_bfast", "read", [path]() {
+        MappedBfast b(path);
+        for (auto range : b.ranges)
+            consume(range);
+    }, before });
+    r.push_back({ "bfast_view", "read", [path, n]() {
+        MappedFile f(path);
+        BfastView view(f.range());
+        for (size_t i = 0; i < n; ++i)
+            consume(view.array(i));
+    }, before });
+    r.push_back({ "read_arrays", "read", [path, n]() {
+        BfastFile f(path);
+        vector<size_t> indices(n);
+        iota(indices.begin(), indices.end(), 0);
+        auto arrays = f.read_arrays(indices);
+        for (auto range : arrays.ranges)
+            consume(range);
+    }, before });
+    r.push_back({ "read_array_each", "read", [path, n]() {
+        BfastFile f(path);
+        for (size_t i = 0; i < n; ++i)
+            consume(f.read_array(i)[0]);
+    }, before });
+    r.push_back({ "stream_reader", "read", [path]() {
+        ifstream in(path, ifstream::in | ifstream::binary);
+        StreamReader reader(in);
+        reader.read([](size_t, const bfast::byte* data, size_t size) { consume({ data, data + size }); });
+    }, before });
+    r.push_back({ "async_reader", "read", [path, n]() {
+        AsyncReader reader;
+        auto file = reader.add_file(path);
+        vector<ReadRequest> requests(n);
+        for (size_t i = 0; i < n; ++i) {
+            requests[i].file = file;
+            requests[i].array = i;
+        }
+        for (auto& read : reader.submit(requests))
+            consume(read->future.get());
+    }, before });
+    return r;
+}
+
+static bool matches(const Options& options, const string& workload, const string& name) {
+    return options.only.empty() || (workload + "/" + name).find(options.only) != string::npos;
+}
+
+static void print_result(const json& r) {
+    auto text = [](const json& value) {
+        if (value.is_null()) return string("-");
+        ostringstream out;
+        out << fixed << setprecision(0) << value.get<double>();
+        return out.str();
+    };
+    cout << left << setw(8) << r["workload"].get<string>()
+        << setw(24) << r["benchmark"].get<string>() << right << fixed << setprecision(3)
+        << setw(10) << r["gbps_best"].get<double>() << " GB/s"
+        << setw(12) << text(r["syscalls"]) << " calls"
+        << setw(12) << text(r["page_faults"]) << " faults";
+    if (!r["added_rss"].is_null())
+        cout << setw(8) << (ulong)r["added_rss"].get<double>() / (1 << 20) << " MB added";
+    cout << endl;
+}
+
+// Compares each result with the result of the same benchmark in an earlier run. Returns the number that are
+// slower by more than the tolerance.
+static size_t compare(const json& results, const string& path, double tolerance) {
+    ifstream in(path);
+    if (!in) throw runtime_error("Could not open baseline: " + path);
+    json baseline;
+    in >> baseline;
+    size_t regressions = 0;
+    for (auto& r : results["results"]) {
+        for (auto& b : baseline["results"]) {
+            if (b["workload"] != r["workload"] || b["benchmark"] != r["benchmark"]) continue;
+            auto before = b["gbps_best"].get<double>(), after = r["gbps_best"].get<double>();
+            auto ratio = after / max(before, 1e-12);
+            auto regressed = ratio < 1 - tolerance;
+            if (regressed) regressions++;
+            cout << left << setw(8) << r["workload"].get<string>() << setw(24) << r["benchmark"].get<string>() << right
+                << fixed << setprecision(3) << setw(10) << before << " -> " << setw(8) << after << " GB/s"
+                << setprecision(2) << setw(8) << ratio << "x" << (regressed ? "  REGRESSION" : "") << endl;
+        }
+    }
+    return regressions;
+}
+
+static string utc_timestamp() {
+    auto t = time(nullptr);
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    return buffer;
+}
+
+static int usage() {
+    cerr << "Usage: bfast-bench [options]" << endl
+        << endl
+        << "Options:" << endl
+        << "  --dir <dir>          Where the benchmark files are written (default: current directory)" << endl
+        << "  --out <file>         Writes the results as JSON" << endl
+        << "  --scale <x>          Multiplies the number or size of the arrays of each workload (default: 1)" << endl
+        << "  --repeat <n>         How many times each benchmark is run (default: 3)" << endl
+        << "  --only <text>        Only runs the benchmarks whose workload/name contains the text" << endl
+        << "  --cold               Evicts the file from the page cache before each read" << endl
+        << "  --baseline <file>    Compares the results with an earlier JSON output, and exits with 3 if any" << endl
+        << "                       benchmark is slower by more than the tolerance" << endl
+        << "  --tolerance <x>      The allowed slowdown when comparing (default: 0.1)" << endl;
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    vector<string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); ++i) {
+        auto value = [&]() -> const string& {
+            if (i + 1 >= args.size()) throw invalid_argument(args[i]);
+            return args[++i];
+        };
+        try {
+            if (args[i] == "--dir") options.dir = value();
+            else if (args[i] == "--out") options.out = value();
+            else if (args[i] == "--scale") options.scale = stod(value());
+            else if (args[i] == "--repeat") options.repeat = max<size_t>(1, stoul(value()));
+            else if (args[i] == "--only") options.only = value();
+            else if (args[i] == "--cold") options.cold = true;
+            else if (args[i] == "--baseline") options.baseline = value();
+            else if (args[i] == "--tolerance") options.tolerance = stod(value());
+            else return usage();
+        }
+        catch (const logic_error&) {
+            return usage();
+        }
+    }
+
+    try {
+        json results = {
+            { "format", 1 },
+            { "timestamp", utc_timestamp() },
+            { "config", {
+                { "scale", options.scale },
+                { "repeat", options.repeat },
+                { "cold", options.cold },
+            } },
+            { "machine", {
+                { "threads", default_num_threads() },
+#if defined(_WIN32)
+                { "os", "windows" },
+#elif defined(__APPLE__)
+                { "os", "macos" },
+#else
+                { "os", "linux" },
+#endif
+                { "peak_rss_per_run", peak_rss_per_run },
+            } },
+            { "results", json::array() },
+        };
+
+        auto workloads = make_workloads(options.scale);
+        for (auto& w : workloads) {
+            auto path = options.dir + "/bfast-bench-" + w->name + ".bfast";
+            auto writes = make_write_benchmarks(*w, path);
+            for (auto& b : writes)
+                if (matches(options, w->name, b.name)) {
+                    results["results"].push_back(run_benchmark(*w, b, path, options));
+                    print_result(results["results"].back());
+                }
+
+            // The reads all use a file written by the plain writer
+            write_file(w->bfast, path);
+            auto reads = make_read_benchmarks(*w, path, options.cold);
+            for (auto& b : reads)
+                if (matches(options, w->name, b.name)) {
+                    results["results"].push_back(run_benchmark(*w, b, path, options));
+                    print_result(results["results"].back());
+                }
+            std::remove(path.c_str());
+        }
+
+        if (!options.out.empty()) {
+            ofstream out(options.out);
+            out << setw(2) << results << endl;
+            if (!out) throw runtime_error("Failed to write results: " + options.out);
+        }
+        if (!options.baseline.empty() && compare(results, options.baseline, options.tolerance) > 0)
+            return 3;
+        return 0;
+    }
+    catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 2;
+    }
+}
@@ -0,0 +1,150 @@
+/*
+    BFAST Tests
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Checks the parts of BFAST that depend on another program behaving, which are hard to exercise by hand. Currently
+    these are the HTTP range reads: a BFAST file is served by HttpFileServer on the loopback address, and the arrays
+    read back with HttpBfast are compared with the ones that were written. The server is configured to pipeline
+    requests normally, to ignore ranges, and to drop connections in the middle of a pipeline.
+
+    Prints each failed check, and exits with 1 if any check failed.
+*/
+#include <ara3d/bfast/bfast_http_server.h>
+#include <ara3d/bfast/bfast_writer.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+using namespace std;
+using namespace bfast;
+
+static int failures = 0;
+
+static void check(bool condition, const string& message) {
+    if (condition) return;
+    cerr << "  FAILED: " << message << endl;
+    failures++;
+}
+
+// A small xorshift generator, so that the data is the same on every platform and every run
+struct Random
+{
+    ulong state;
+    explicit Random(ulong seed) : state(seed) { }
+    ulong next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+};
+
+// Writes a BFAST file with checksums, holding arrays from empty to larger than the socket buffer, and returns the
+// contents of each array
+static vector<vector<bfast::byte>> write_test_file(const string& path) {
+    Random random(42);
+    vector<vector<bfast::byte>> r;
+    for (size_t i = 0; i < 200; ++i) {
+        size_t size = i % 17 == 0 ? 0 : i % 50 == 1 ? (size_t)(random.next() % (3 << 20)) : (size_t)(random.next() % 5000);
+        vector<bfast::byte> data(size);
+        for (auto& b : data)
+            b = (bfast::byte)random.next();
+        r.push_back(move(data));
+    }
+    Bfast b;
+    for (auto& data : r)
+        b.add_array(data.data(), data.data() + data.size());
+    WriteOptions options;
+    options.checksums = true;
+    write_file(b, path, options);
+    return r;
+}
+
+// Reads the arrays through the server and compares them with the arrays that were written
+static void check_arrays(HttpBfast& b, const vector<vector<bfast::byte>>& expected, const vector<size_t>& indices, size_t gap_threshold) {
+    auto arrays = b.read_arrays(indices, gap_threshold);
+    check(arrays.num_arrays() == indices.size(), "one range per requested array");
+    for (size_t i = 0; i < indices.size() && i < arrays.num_arrays(); ++i) {
+        auto& e = expected[indices[i]];
+        auto a = arrays[i];
+        check(a.size() == e.size() && (e.empty() || memcmp(a.begin(), e.data(), e.size()) == 0),
+            "contents of array " + to_string(indices[i]));
+    }
+}
+
+static vector<size_t> all_indices(size_t n) {
+    vector<size_t> r;
+    for (size_t i = 0; i < n; ++i)
+        r.push_back(i);
+    return r;
+}
+
+// Every array, each with its own request, so that many requests are pipelined over one connection
+static void test_pipelined(HttpFileServer& server, const vector<vector<bfast::byte>>& expected, const string& name) {
+    HttpBfast b(server.url(name));
+    check(b.num_arrays() == expected.size(), "number of arrays");
+    check(!b.checksums.empty(), "checksums are read");
+    check_arrays(b, expected, all_indices(expected.size()), 0);
+    check(b.stats.connections == 1, "one connection for all of the requests, not " + to_string(b.stats.connections));
+    check(b.stats.requests > b.max_in_flight, "more requests than fit in one pipeline");
+}
+
+// Coalesced reads of some of the arrays, in an order other than the file order
+static void test_coalesced(HttpFileServer& server, const vector<vector<bfast::byte>>& expected, const string& name) {
+    HttpBfast b(server.url(name));
+    vector<size_t> indices = { 150, 3, 4, 5, 0, 199, 1, 51, 17, 5 };
+    auto requests = b.stats.requests;
+    check_arrays(b, expected, indices, 64 << 10);
+    check(b.stats.requests - requests < indices.size(), "nearby arrays are fetched with one request");
+}
+
+// A server without range support answers every request with the whole file
+static void test_without_ranges(HttpFileServer& server, const vector<vector<bfast::byte>>& expected, const string& name) {
+    server.ranges = false;
+    HttpBfast b(server.url(name));
+    check_arrays(b, expected, { 1, 2, 100, 51, 0 }, 0);
+    check_arrays(b, expected, all_indices(expected.size()), 64 << 10);
+    check(b.stats.connections == 1, "the whole file is skipped over without reconnecting");
+}
+
+// A server that closes the connection with requests still in the pipeline, which must be sent again
+static void test_dropped_connections(HttpFileServer& server, const vector<vector<bfast::byte>>& expected, const string& name) {
+    server.drop_after = 5;
+    HttpBfast b(server.url(name));
+    check_arrays(b, expected, all_indices(expected.size()), 0);
+    check(b.stats.connections > expected.size() / 5, "a new connection after each drop, not " + to_string(b.stats.connections));
+}
+
+int main() {
+    const string name = "bfast-test-http.bfast";
+    auto expected = write_test_file(name);
+    HttpFileServer server(".");
+
+    vector<pair<string, function<void()>>> tests = {
+        { "pipelined", [&]() { test_pipelined(server, expected, name); } },
+        { "coalesced", [&]() { test_coalesced(server, expected, name); } },
+        { "without ranges", [&]() { test_without_ranges(server, expected, name); } },
+        { "dropped connections", [&]() { test_dropped_connections(server, expected, name); } },
+    };
+    for (auto& test : tests) {
+        cout << test.first << endl;
+        server.ranges = true;
+        server.drop_after = 0;
+        try {
+            test.second();
+        }
+        catch (const exception& e) {
+            check(false, e.what());
+        }
+    }
+
+    server.stop();
+    remove(name.c_str());
+    cout << (failures == 0 ? "All tests passed" : to_string(failures) + " checks failed") << endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,267 @@
+/*
+    BFAST Command Line Tool
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Inspects and maintains BFAST files.
+*/
+#include <ara3d/bfast/bfast_journal.h>
+#include <ara3d/bfast/bfast_merge.h>
+#include <ara3d/bfast/bfast_http_server.h>
+#include <ara3d/g3d/g3d_catalog.h>
+#include <ara3d/g3d/g3d_subset.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <map>
+#include <tuple>
+
+using namespace std;
+using namespace bfast;
+
+static int usage() {
+    cerr << "Usage: bfast-tool <command> [arguments]" << endl
+        << endl
+        << "Commands:" << endl
+        << "  info <file>                  Prints the arrays of a BFAST file and how much space is unused" << endl
+        << "  compact <file> [--dedup]     Rewrites a BFAST file without the space left unused by updates" << endl
+        << "  repack <input> <output>      Writes a copy of a BFAST file with a fresh layout" << endl
+        << "  concat <output> <inputs...>  Writes a BFAST with all of the arrays of the input BFAST files" << endl
+        << "  merge <output> <inputs...>   Writes a BFAST with each input file as a named array" << endl
+        << "  copy <input> <output> [--direct]" << endl
+        << "                               Rewrites a BFAST file, reporting the throughput and page cache use" << endl
+        << "  catalog <dir> <catalog>      Creates or updates a catalog of the G3D and BFAST files in a directory tree" << endl
+        << "  inventory <catalog>          Prints totals for the files and attributes in a catalog" << endl
+        << "  g3d <file>                   Prints the header and attributes of a G3D file" << endl
+        << "  subset <file> [--map] <patterns...>" << endl
+        << "                               Loads the attributes of a G3D matching patterns such as g3d:vertex:*" << endl
+        << "  serve <dir> [port]           Serves the files in a directory over HTTP with range requests, for testing" << endl
+        << "  fetch <url> <indices...>     Downloads selected arrays of a BFAST with HTTP range requests" << endl;
+    return 1;
+}
+
+static int info(const vector<string>& args) {
+    if (args.size() != 1) return usage();
+    BfastUpdater u(args[0], file_read);
+    cout << "File: " << args[0] << endl
+        << "Size: " << u.file.size() << " bytes" << endl
+        << "Arrays: " << u.num_arrays() << endl
+        << "Generation: " << u.generation << endl
+        << "Checksums: " << (u.checksums.empty() ? "no" : "yes") << endl
+        << "Live bytes: " << u.live_bytes() << endl
+        << "Dead bytes: " << u.dead_bytes() << endl;
+    for (size_t i = 0; i < u.offsets.size(); ++i)
+        cout << "  [" << i << "] " << u.offsets[i]._begin << " - " << u.offsets[i]._end << " (" << u.offsets[i]._end - u.offsets[i]._begin << " bytes)" << endl;
+    return 0;
+}
+
+static int compact(const vector<string>& args) {
+    if (args.empty()) return usage();
+    WriteOptions options;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--dedup") options.dedup = true;
+        else return usage();
+    }
+    ulong before = 0;
+    {
+        File f(args[0], file_read);
+        before = f.size();
+    }
+    compact_file(args[0], options);
+    File f(args[0], file_read);
+    cout << "Compacted " << args[0] << " from " << before << " to " << f.size() << " bytes" << endl;
+    return 0;
+}
+
+static void print_stats(const string& path, const CopyStats& stats) {
+    File f(path, file_read);
+    cout << "Wrote " << path << " (" << f.size() << " bytes): " 
+        << stats.kernel_bytes << " bytes copied in the kernel, " 
+        << stats.buffered_bytes << " bytes copied through memory, " 
+        << stats.calls << " calls" << endl;
+}
+
+static int repack(const vector<string>& args) {
+    if (args.size() != 2) return usage();
+    print_stats(args[1], repack_file(args[0], args[1]));
+    return 0;
+}
+
+static int concat(const vector<string>& args) {
+    if (args.size() < 2) return usage();
+    vector<string> inputs(args.begin() + 1, args.end());
+    print_stats(args[0], concat_files(inputs, args[0]));
+    return 0;
+}
+
+static int merge(const vector<string>& args) {
+    if (args.size() < 2) return usage();
+    vector<string> inputs(args.begin() + 1, args.end());
+    vector<string> names;
+    for (auto& input : inputs)
+        names.push_back(input.substr(input.find_last_of("/\\") + 1));
+    print_stats(args[0], merge_files(inputs, args[0], names));
+    return 0;
+}
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static int copy(const vector<string>& args) {
+    if (args.size() < 2) return usage();
+    WriteOptions options;
+    for (size_t i = 2; i < args.size(); ++i) {
+        if (args[i] == "--direct") options.direct = true;
+        else return usage();
+    }
+    MappedBfast input(args[0]);
+    Bfast b;
+    b.ranges = input.ranges;
+    options.checksums = input.checksums.enabled();
+    auto start = chrono::steady_clock::now();
+    write_file(b, args[1], options);
+    auto seconds = seconds_since(start);
+
+    File f(args[1], file_read);
+    cout << "Wrote " << args[1] << " (" << f.size() << " bytes) in " << seconds << " s, " 
+        << f.size() / max(seconds, 1e-9) / (1 << 20) << " MB/s" << endl;
+    ulong resident = 0;
+    if (page_cache_bytes(args[1], resident))
+        cout << "Page cache: " << resident << " bytes of the output are cached" << endl;
+    return 0;
+}
+
+static int catalog(const vector<string>& args) {
+    if (args.size() != 2) return usage();
+    auto start = chrono::steady_clock::now();
+    auto stats = g3d::build_catalog(args[0], args[1]);
+    cout << "Cataloged " << stats.files << " files in " << seconds_since(start) << " s: " 
+        << stats.read << " read, " << stats.reused << " unchanged, " 
+        << stats.removed << " removed, " << stats.invalid << " invalid" << endl;
+    return 0;
+}
+
+static int inventory(const vector<string>& args) {
+    if (args.size() != 1) return usage();
+    auto start = chrono::steady_clock::now();
+    g3d::Catalog c(args[0]);
+    ulong total_bytes = 0, total_arrays = 0;
+    size_t num_g3d = 0, num_invalid = 0;
+    // Totals are grouped by the raw descriptor fields, and only turned into strings for printing
+    struct Totals { size_t files; ulong bytes; };
+    map<tuple<int, int, int, int, int>, Totals> attributes;
+    for (size_t i = 0; i < c.size(); ++i) {
+        auto& e = c.entry(i);
+        total_bytes += e.size;
+        total_arrays += e.num_arrays;
+        if (!(e.flags & g3d::catalog_bfast)) num_invalid++;
+        if (!(e.flags & g3d::catalog_g3d)) continue;
+        num_g3d++;
+        auto offsets = c.offsets(i);
+        auto descriptors = c.descriptors(i);
+        for (size_t j = 0; j < e.num_descriptors; ++j) {
+            auto& d = descriptors[j];
+            auto& totals = attributes[make_tuple(d._association, d._attribute_type, d._attribute_type_index, d._data_type, d._data_arity)];
+            totals.files++;
+            totals.bytes += offsets[j + 2]._end - offsets[j + 2]._begin;
+        }
+    }
+    auto seconds = seconds_since(start);
+    cout << "Files: " << c.size() << " (" << num_g3d << " G3D, " << num_invalid << " invalid)" << endl
+        << "Bytes: " << total_bytes << endl
+        << "Arrays: " << total_arrays << endl
+        << "Attributes:" << endl;
+    for (auto& kv : attributes) {
+        g3d::AttributeDescriptor d = {};
+        tie(d._association, d._attribute_type, d._attribute_type_index, d._data_type, d._data_arity) = kv.first;
+        cout << "  " << d.to_string() << ": " << kv.second.files << " files, " << kv.second.bytes << " bytes" << endl;
+    }
+    cout << "Query took " << seconds * 1000 << " ms" << endl;
+    return 0;
+}
+
+static int g3d_info(const vector<string>& args) {
+    if (args.size() != 1) return usage();
+    MappedFile f(args[0]);
+    auto start = chrono::steady_clock::now();
+    g3d::G3dView g(f.range());
+    auto seconds = seconds_since(start);
+    cout << "File: " << args[0] << endl
+        << "Header: " << g.header_string() << endl
+        << "Attributes: " << g.num_attributes() << endl;
+    for (auto& a : g.attributes)
+        cout << "  " << a.descriptor.to_string() << ": " << a.num_elements() << " elements, " << a.byte_size() << " bytes" << endl;
+    cout << "Parsed in " << seconds * 1000 << " ms" << endl;
+    return 0;
+}
+
+static int subset(const vector<string>& args) {
+    vector<g3d::AttributeFilter> filters;
+    auto map = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--map") map = true;
+        else filters.push_back(g3d::AttributeFilter::parse(args[i]));
+    }
+    if (args.empty() || filters.empty()) return usage();
+    auto s = map ? g3d::map_g3d_subset(args[0], filters) : g3d::load_g3d_subset(args[0], filters);
+    for (auto& a : s.view.attributes)
+        cout << "  " << a.descriptor.to_string() << ": " << a.num_elements() << " elements, " << a.byte_size() << " bytes" << endl;
+    cout << "Loaded " << s.stats.attributes_loaded << " of " << s.stats.attributes_loaded + s.stats.attributes_skipped
+        << " attributes, skipping " << s.stats.bytes_skipped << " bytes" << endl
+        << (map ? "Accessed " : "Read ") << s.stats.bytes_read << " bytes";
+    if (!map) cout << " with " << s.stats.reads << " reads";
+    cout << " in " << s.stats.seconds * 1000 << " ms" << endl;
+    return 0;
+}
+
+static int serve(const vector<string>& args) {
+    if (args.empty() || args.size() > 2) return usage();
+    HttpFileServer server(args[0], args.size() > 1 ? (unsigned short)stoi(args[1]) : 8080);
+    cout << "Serving " << args[0] << " at " << server.url("") << endl;
+    while (true)
+        this_thread::sleep_for(chrono::seconds(1));
+}
+
+static int fetch(const vector<string>& args) {
+    if (args.empty()) return usage();
+    auto start = chrono::steady_clock::now();
+    HttpBfast b(args[0]);
+    vector<size_t> indices;
+    for (size_t i = 1; i < args.size(); ++i)
+        indices.push_back((size_t)stoull(args[i]));
+    auto arrays = b.read_arrays(indices);
+    auto seconds = seconds_since(start);
+    for (size_t i = 0; i < indices.size(); ++i)
+        cout << "  [" << indices[i] << "] " << arrays[i].size() << " bytes" << endl;
+    cout << "Downloaded " << b.stats.bytes_downloaded << " of " << b.file_size << " bytes with " 
+        << b.stats.requests << " requests over " << b.stats.connections << " connections in " << seconds << " s" << endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) return usage();
+    string command = argv[1];
+    vector<string> args(argv + 2, argv + argc);
+    try {
+        if (command == "info") return info(args);
+        if (command == "compact") return compact(args);
+        if (command == "repack") return repack(args);
+        if (command == "concat") return concat(args);
+        if (command == "merge") return merge(args);
+        if (command == "copy") return copy(args);
+        if (command == "catalog") return catalog(args);
+        if (command == "inventory") return inventory(args);
+        if (command == "g3d") return g3d_info(args);
+        if (command == "subset") return subset(args);
+        if (command == "serve") return serve(args);
+        if (command == "fetch") return fetch(args);
+        return usage();
+    }
+    catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 2;
+    }
+}
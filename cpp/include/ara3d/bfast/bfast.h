@@ -13,6 +13,10 @@
 #include <iostream>
 #include <iterator>
 #include <fstream>
+#include <stdexcept>
+#include <cstring>
+
+#include "bfast_arena.h"
 
 namespace bfast
 {
@@ -63,6 +67,29 @@ namespace bfast
         ulong num_arrays;	// number of array_headers
     };
 
+    // The optional header extension lives in the 32 bytes of padding between the header and the array offsets
+    static const int header_extension_offset = 32;
+
+    // Optional values stored in the padding after the header. Files written without them have zeros here, and readers 
+    // that do not know about them skip the padding, so they stay compatible. A value of zero means a feature is absent.
+    struct alignas(8) HeaderExtension {
+        ulong checksums;	// Offset of the checksum table, which is stored after data_end 
+        ulong journal;		// Offset of the latest array offsets table written by an update, stored after data_end
+        ulong reserved[2];	// Zero
+    };
+
+    // Identifies an array offsets table appended by an update 
+    const unsigned int JOURNAL_MAGIC = 0xBFA7;
+
+    // Precedes the array offsets of each generation appended by an update. Arrays replaced by an update are appended 
+    // to the file, followed by a complete new table of array offsets, and the header extension is then pointed at it.
+    struct alignas(8) JournalHeader {
+        ulong magic;		// JOURNAL_MAGIC
+        ulong generation;	// One for the first update, and increasing by one with each update
+        ulong num_arrays;	// The number of array offsets that follow
+        ulong data_end;		// The end of the furthest array of this generation, which is before the table
+    };
+
     // A helper struct for representing a range of bytes 
     struct ByteRange {
         const byte* _begin;
@@ -72,51 +99,204 @@ namespace bfast
         size_t size() const { return end() - begin(); }
     };
 
+    // A block of zero bytes used for padding arrays to alignment
+    static const byte zero_padding[alignment] = {};
+
+    // Computes where the first array data starts for a BFAST with the given number of arrays
+    static size_t compute_data_start(size_t num_arrays) {
+        size_t r = 0;
+        r += header_size;
+        r = aligned_value(r);
+        r += array_offset_size * num_arrays;
+        r = aligned_value(r);
+        return r;
+    }
+
+    // Computes the layout of a BFAST holding arrays of the given sizes, in bytes. 
+    // The layout only depends on the sizes, so it is known before any of the array data exists.
+    static vector<ArrayOffset> compute_offsets(const vector<size_t>& sizes) {
+        size_t n = compute_data_start(sizes.size());
+        vector<ArrayOffset> r;
+        r.reserve(sizes.size());
+        for (auto size : sizes) {
+            assert(is_aligned(n));
+            ArrayOffset offset = { n, n + size };
+            r.push_back(offset);
+            n += size;
+            n = aligned_value(n);
+        }
+        return r;
+    }
+
+    // Computes the layout of a BFAST where some arrays share the bytes of an earlier array instead of being stored again.
+    // sources[i] is the index of the array whose bytes array i uses, which is i itself for arrays that are stored.  
+    static vector<ArrayOffset> compute_offsets(const vector<size_t>& sizes, const vector<size_t>& sources) {
+        assert(sizes.size() == sources.size());
+        size_t n = compute_data_start(sizes.size());
+        vector<ArrayOffset> r;
+        r.reserve(sizes.size());
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            if (sources[i] != i) {
+                assert(sources[i] < i && sizes[sources[i]] == sizes[i]);
+                r.push_back(r[sources[i]]);
+                continue;
+            }
+            ArrayOffset offset = { n, n + sizes[i] };
+            r.push_back(offset);
+            n += sizes[i];
+            n = aligned_value(n);
+        }
+        return r;
+    }
+
+    // Computes how many bytes are needed to store a BFAST with the given layout 
+    static size_t compute_needed_size(const vector<ArrayOffset>& offsets) {
+        size_t r = compute_data_start(offsets.size());
+        for (auto& offset : offsets)
+            r = max<size_t>(r, offset._end);
+        return r;
+    }
+
+    // Fills out the header for a BFAST with the given array offsets
+    static Header make_header(const vector<ArrayOffset>& offsets, ulong magic = MAGIC) {
+        Header h;
+        h.magic = magic;
+        h.num_arrays = offsets.size();
+        h.data_start = offsets.empty() ? 0 : offsets.front()._begin;
+        h.data_end = offsets.empty() ? 0 : compute_needed_size(offsets);
+        return h;
+    }
+
+    // Checks that the header values are sensible for a BFAST blob of the given size, and throws an exception otherwise.
+    // Variants of the format that share the layout, such as compressed BFASTs, are identified by a different magic number. 
+    static void validate_header(const Header& h, size_t size, ulong magic = MAGIC) {
+        if (size < header_size) throw runtime_error("Data is smaller than a BFAST header");
+        if (h.magic == SWAPPED_MAGIC) throw runtime_error("BFAST was written on a machine with different endianness");
+        if (h.magic != magic) throw runtime_error("Invalid BFAST magic number");
+        if (h.num_arrays > (size - header_size) / array_offset_size) throw runtime_error("Number of arrays exceeds the size of the data");
+        // An empty BFAST is written with zero for data start and end 
+        if (h.num_arrays == 0) return;
+        if (size < array_offsets_start + h.num_arrays * array_offset_size) throw runtime_error("Array offsets exceed the size of the data");
+        if (h.data_start < array_offsets_start + h.num_arrays * array_offset_size) throw runtime_error("Data start overlaps the array offsets");
+        if (h.data_start > h.data_end) throw runtime_error("Data start is after data end");
+        if (h.data_end > size) throw runtime_error("Data end is past the end of the data");
+    }
+
+    // Checks that an array offset falls within the data section described by the header, and throws an exception otherwise.
+    // Offsets are not required to be ordered or disjoint, so several arrays may share the same bytes. 
+    static void validate_offset(const Header& h, const ArrayOffset& offset) {
+        if (offset._begin < h.data_start) throw runtime_error("Array begins before the data start");
+        if (offset._end < offset._begin) throw runtime_error("Array ends before it begins");
+        if (offset._end > h.data_end) throw runtime_error("Array ends after the data end");
+    }
+
+    // Returns the header at the front of a BFAST blob, after validating it. 
+    static const Header& get_header(ByteRange bytes, ulong magic = MAGIC) {
+        if (bytes.size() < header_size) throw runtime_error("Data is smaller than a BFAST header");
+        auto& h = *(const Header*)bytes.begin();
+        validate_header(h, bytes.size(), magic);
+        return h;
+    }
+
+    // Returns a pointer to the array offsets of a BFAST blob, after validating the header. 
+    inline const ArrayOffset* get_offsets(ByteRange bytes, ulong magic = MAGIC) {
+        get_header(bytes, magic);
+        return (const ArrayOffset*)(bytes.begin() + array_offsets_start);
+    }
+
+    // Returns the header extension of a BFAST blob, or zeros if it is too small to have one 
+    static HeaderExtension get_header_extension(ByteRange bytes) {
+        HeaderExtension r = {};
+        if (bytes.size() >= array_offsets_start)
+            memcpy(&r, bytes.begin() + header_extension_offset, sizeof(r));
+        return r;
+    }
+
+    // Writes the header extension into a preamble computed by Bfast::compute_preamble 
+    static void set_header_extension(vector<byte>& preamble, const HeaderExtension& ext) {
+        assert(preamble.size() >= array_offsets_start);
+        memcpy(preamble.data() + header_extension_offset, &ext, sizeof(ext));
+    }
+
+    // Returns the header that describes the arrays of the latest journal generation, after validating the journal header. 
+    // The array offsets of the generation must be within the data of the original header, or the data appended after it.
+    static Header get_journal_header(const Header& h, const JournalHeader& j, ulong position, ulong size) {
+        if (j.magic != JOURNAL_MAGIC) throw runtime_error("Invalid BFAST journal");
+        if (position > size || size - position < sizeof(JournalHeader)) throw runtime_error("BFAST journal is truncated");
+        if (j.num_arrays > (size - position - sizeof(JournalHeader)) / array_offset_size) throw runtime_error("BFAST journal is truncated");
+        if (j.data_end > position) throw runtime_error("BFAST journal overlaps the array data");
+        Header r = h;
+        r.data_start = max<ulong>(h.data_start, compute_data_start(h.num_arrays));
+        r.data_end = j.data_end;
+        r.num_arrays = j.num_arrays;
+        return r;
+    }
+
+    // Finds the array offsets of a BFAST blob, following the journal to the latest generation if it has been updated.
+    // Returns the position of the offsets in the blob, and sets the header to the one that describes them.  
+    static ulong get_latest_offsets_position(ByteRange bytes, Header& h, ulong magic = MAGIC) {
+        h = get_header(bytes, magic);
+        auto position = get_header_extension(bytes).journal;
+        if (position == 0) return array_offsets_start;
+        if (position > bytes.size() || bytes.size() - position < sizeof(JournalHeader)) throw runtime_error("BFAST journal is truncated");
+        JournalHeader j;
+        memcpy(&j, bytes.begin() + position, sizeof(j));
+        h = get_journal_header(h, j, position, bytes.size());
+        return position + sizeof(JournalHeader);
+    }
+
+    // Returns a byte range for each array in a BFAST blob. The ranges point into the blob, no data is copied.  
+    // If the blob has been updated the arrays of the latest generation are returned. 
+    static vector<ByteRange> get_ranges(ByteRange bytes, ulong magic = MAGIC) {
+        Header h;
+        auto offsets = (const ArrayOffset*)(bytes.begin() + get_latest_offsets_position(bytes, h, magic));
+        vector<ByteRange> r;
+        r.reserve(h.num_arrays);
+        for (size_t i = 0; i < h.num_arrays; ++i) {
+            validate_offset(h, offsets[i]);
+            r.push_back({ bytes.begin() + offsets[i]._begin, bytes.begin() + offsets[i]._end });
+        }
+        return r;
+    }
+
     // Stores ranges of byte pointers to arrays and copies a BFAST into memory  
     struct Bfast
     {
-        // When local copies of data are required 
+        // Buffers whose ownership was passed to the Bfast with move_buffer. Moving a vector keeps its data in place,
+        // so the ranges into them stay valid. 
         vector<vector<byte>> buffers;
 
+        // Memory for arrays that are copied into the Bfast or allocated by it  
+        Arena arena;
+
         // Data is passed to a BfastBuilder as byte ranges
         vector<ByteRange> ranges;
 
+        // Written in the header, identifies the format variant 
+        ulong magic = MAGIC;
+
         // Computes where the data offsets are relative to the beginning of the BFAST byte stream.
-        vector<ArrayOffset> compute_offsets() {
-            size_t n = compute_data_start();
-            vector<ArrayOffset> r;
-            for (auto range : ranges) {
-                assert(is_aligned(n));
-                ArrayOffset offset = { n, n + range.size() };
-                r.push_back(offset);
-                n += range.size();
-                n = aligned_value(n);
-            }
-            return r;
+        vector<ArrayOffset> compute_offsets() const {
+            vector<size_t> sizes;
+            for (auto range : ranges)
+                sizes.push_back(range.size());
+            return bfast::compute_offsets(sizes);
         }
 
         // Computes where the first array data starts 
-        size_t compute_data_start() {
-            size_t r = 0;
-            r += header_size;
-            r = aligned_value(r);
-            r += array_offset_size * ranges.size();
-            r = aligned_value(r);
-            return r;
+        size_t compute_data_start() const {
+            return bfast::compute_data_start(ranges.size());
         }
 
         // Computes how many bytes are needed to store the current BFAST blob
-        size_t compute_needed_size() {
-            auto tmp = compute_offsets();
-            if (tmp.size() == 0)
-                return compute_data_start();
-            return tmp.back()._end;
+        size_t compute_needed_size() const {
+            return bfast::compute_needed_size(compute_offsets());
         }
 
         // Copies the data structure to the bytes stream and update the current index
         template<typename T, typename OutIter_T>
-        OutIter_T copy_to(T& x, OutIter_T out, int& current) {
-            auto begin = (char*)&x;
+        static OutIter_T copy_to(const T& x, OutIter_T out, size_t& current) {
+            auto begin = (const byte*)&x;
             auto end = begin + sizeof(T);
             current += sizeof(T);
             return std::copy(begin, end, out);
@@ -124,37 +304,24 @@ namespace bfast
 
         // Adds zero bytes to the bytes stream for null padding 
         template<typename OutIter_T>
-        OutIter_T output_padding(OutIter_T out, int& current) {
+        static OutIter_T output_padding(OutIter_T out, size_t& current) {
             while (!is_aligned(current)) {
-                *out++ = (char)0;
+                *out++ = (byte)0;
                 current++;
             }
             return out;
         }
 
-        // Copies the BFAST data structure to the byte stream
+        // Copies the header, the array offsets, and the padding that precede the array data to the byte stream
         template<typename OutIter_T>
-        OutIter_T copy_to_iterator(OutIter_T out) {
-            // Initialize and get the data offsets 
-            auto offsets = compute_offsets();
-            assert(offsets.size() == ranges.size());
-            auto n = offsets.size();
-            auto current = 0;
-
-            // Fill out the header
-            Header h;
-            h.magic = MAGIC;
-            h.num_arrays = n;
-            h.data_start = n == 0 ? 0 : offsets.front()._begin;
-            h.data_end = n == 0 ? 0 : offsets.back()._end;
-
+        static OutIter_T copy_preamble_to_iterator(const vector<ArrayOffset>& offsets, OutIter_T out, size_t& current, ulong magic = MAGIC) {
             // Copy the header and add padding 
-            out = copy_to(h, out, current);
+            out = copy_to(make_header(offsets, magic), out, current);
             out = output_padding(out, current);
             assert(is_aligned(current));
 
             // Early escape if there are no offsets 
-            if (n == 0)
+            if (offsets.empty())
                 return out;
 
             // Copy the array offsets and add padding 
@@ -162,41 +329,71 @@ namespace bfast
                 out = copy_to(off, out, current);
             out = output_padding(out, current);
             assert(is_aligned(current));
-            assert(current = compute_data_start());
+            return out;
+        }
+
+        // Returns the header, the array offsets, and the padding that precede the array data as a block of bytes. 
+        static vector<byte> compute_preamble(const vector<ArrayOffset>& offsets, ulong magic = MAGIC) {
+            vector<byte> r;
+            size_t current = 0;
+            copy_preamble_to_iterator(offsets, back_inserter(r), current, magic);
+            return r;
+        }
 
-            // Copy the arrays 
-            for (auto i = 0; i < ranges.size(); ++i) {
+        // Copies the BFAST data structure to the byte stream
+        template<typename OutIter_T>
+        OutIter_T copy_to_iterator(OutIter_T out) const {
+            // Initialize and get the data offsets 
+            auto offsets = compute_offsets();
+            assert(offsets.size() == ranges.size());
+            size_t current = 0;
+            out = copy_preamble_to_iterator(offsets, out, current, magic);
+            assert(current == compute_data_start());
+
+            // Copy the arrays, padding in between them but not after the last one so that the stream ends at data_end 
+            for (size_t i = 0; i < ranges.size(); ++i) {
                 auto range = ranges[i];
                 auto offset = offsets[i];
+                out = output_padding(out, current);
                 assert(current == offset._begin);
                 out = copy(range.begin(), range.end(), out);
                 current += range.size();
                 assert(current == offset._end);
-                output_padding(out, current);
             }
             return out;
         }
 
-        // Outputs a G3D object to a strean
-        ostream& copy_to_stream(ostream& out = cout) {
-            copy_to_iterator(ostream_iterator<byte>(out));
+        // Outputs a BFAST to a stream. Each array is written with a single call, instead of byte by byte. 
+        ostream& copy_to_stream(ostream& out = cout) const {
+            auto offsets = compute_offsets();
+            auto preamble = compute_preamble(offsets, magic);
+            out.write((const char*)preamble.data(), preamble.size());
+            size_t current = preamble.size();
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                out.write((const char*)zero_padding, offsets[i]._begin - current);
+                out.write((const char*)ranges[i].begin(), ranges[i].size());
+                current = offsets[i]._end;
+            }
             return out;
         }
 
-        // Outputs a G3D object to a file
-        ostream& copy_to_file(string path) {
-            return copy_to_stream(ofstream(path, ofstream::out));
+        // Outputs a BFAST to a file. See also bfast::write_file for a faster writer using gather writes.   
+        void copy_to_file(const string& path) const {
+            ofstream out(path, ofstream::out | ofstream::binary);
+            if (!out) throw runtime_error("Could not open file for writing: " + path);
+            copy_to_stream(out);
+            if (!out) throw runtime_error("Failed to write file: " + path);
         }
 
         // Copies the G3D object into the vector, resizing it appropriately.
-        vector<byte>& copy_to_bytes(vector<byte>& bytes) {
+        vector<byte>& copy_to_bytes(vector<byte>& bytes) const {
             bytes.resize(compute_needed_size());
             copy_to_iterator(bytes.data());
             return bytes;
         }
 
         // Copies a G3D object into a vector byte set 
-        vector<byte> copy_to_bytes() {
+        vector<byte> copy_to_bytes() const {
             vector<byte> bytes;
             copy_to_bytes(bytes);
             return bytes;
@@ -223,17 +420,32 @@ namespace bfast
             add_array(object, object + 1);
         }
 
+        // Adds a new array of the given size owned by the Bfast, and returns the memory for the caller to fill in.
+        // The memory is 64-byte aligned and stays at the same address until the Bfast is destroyed.
+        byte* allocate_array(size_t size) {
+            auto r = arena.allocate(size);
+            add_array(r, r + size);
+            return r;
+        }
+
+        // Stores a copy of the bytes in the arena and adds them as a new array. 
+        void copy_array(const void* begin, const void* end) {
+            auto size = (const byte*)end - (const byte*)begin;
+            auto p = allocate_array(size);
+            if (size > 0)
+                memcpy(p, begin, size);
+        }
+
         // Stores a copy of the buffer and pushes the bytes into the G3D container.
         void copy_buffer(const vector<byte>& data) {
-            buffers.push_back(data);
-            auto back = buffers.back();
-            add_array(back.data, back.data + back.size());
+            copy_array(data.data(), data.data() + data.size());
         }
 
-        // Moves a buffer into local storate, and passes the range to the G3D container. 
+        // Moves a buffer into local storage, and passes the range to the G3D container. The data is not copied. 
         void move_buffer(vector<byte>&& data) {
-            auto back = buffers.back();
-            add_array(back.data, back.data + back.size());
+            buffers.push_back(move(data));
+            auto& back = buffers.back();
+            add_array(back.data(), back.data() + back.size());
         }
     };
 }
\ No newline at end of file
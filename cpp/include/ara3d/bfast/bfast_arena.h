@@ -0,0 +1,138 @@
+/*
+    BFAST Arena Allocator
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+*/
+#pragma once
+
+#include <vector>
+#include <new>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+namespace bfast
+{
+    using namespace std;
+
+    // The alignment of every allocation made from an arena 
+    static const size_t arena_alignment = 64;
+
+    // Where an arena gets its chunks from, when they should not come from the heap. This keeps the OS specific ways of 
+    // getting memory, such as the huge pages of bfast_huge_pages.h, out of the headers that every program includes.
+    struct ChunkAllocator
+    {
+        // Returns memory for at least size bytes, aligned to arena_alignment, and sets size to the number of bytes 
+        // actually obtained. Returns null if no memory is available this way, in which case the heap is used instead.
+        virtual uint8_t* allocate(size_t& size) = 0;
+
+        // Releases memory returned by allocate, with the size it was set to
+        virtual void release(uint8_t* p, size_t size) = 0;
+
+        virtual ~ChunkAllocator() { }
+    };
+
+    // Owns memory for many arrays, handed out from a list of large chunks. Every allocation is 64-byte aligned and
+    // keeps its address until the arena is cleared or destroyed, so ranges pointing into it stay valid however many
+    // arrays are added. Allocating is just bumping a pointer, so builders that create thousands of small arrays do
+    // not make a heap allocation for each one. Memory is only returned all at once.
+    // Chunks are aligned heap allocations, unless a ChunkAllocator is given, for example to back them with huge pages,
+    // which reduces TLB misses when walking large amounts of data.
+    struct Arena
+    {
+        struct Chunk {
+            uint8_t* _begin;
+            size_t size;
+            size_t used;
+            bool from_allocator;
+        };
+
+        vector<Chunk> chunks;
+        size_t chunk_size;
+        ChunkAllocator* allocator;
+
+        explicit Arena(size_t chunk_size = 1 << 20, ChunkAllocator* allocator = nullptr)
+            : chunk_size(max<size_t>(chunk_size, arena_alignment)), allocator(allocator)
+        { }
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        Arena(Arena&& other) : chunk_size(other.chunk_size), allocator(other.allocator) { chunks.swap(other.chunks); }
+        Arena& operator=(Arena&& other) { clear(); chunks.swap(other.chunks); chunk_size = other.chunk_size; allocator = other.allocator; return *this; }
+        ~Arena() { clear(); }
+
+        // Returns uninitialized memory for n bytes, aligned to 64 bytes
+        uint8_t* allocate(size_t n) {
+            n = (n + arena_alignment - 1) / arena_alignment * arena_alignment;
+            if (n == 0) n = arena_alignment;
+            if (!chunks.empty() && chunks.back().size - chunks.back().used >= n)
+                return bump(chunks.back(), n);
+            auto chunk = allocate_chunk(max(n, chunk_size));
+            // A large allocation gets a chunk of its own, placed before the current one so its free space is not lost
+            if (n > chunk_size / 2 && !chunks.empty()) {
+                chunks.insert(chunks.end() - 1, chunk);
+                return bump(chunks[chunks.size() - 2], n);
+            }
+            chunks.push_back(chunk);
+            return bump(chunks.back(), n);
+        }
+
+        // Releases all of the memory
+        void clear() {
+            for (auto& c : chunks)
+                free_chunk(c);
+            chunks.clear();
+        }
+
+        // The total number of bytes obtained from the OS
+        size_t bytes_reserved() const {
+            size_t r = 0;
+            for (auto& c : chunks) r += c.size;
+            return r;
+        }
+
+        // The number of bytes handed out, including alignment padding
+        size_t bytes_used() const {
+            size_t r = 0;
+            for (auto& c : chunks) r += c.used;
+            return r;
+        }
+
+        static uint8_t* bump(Chunk& c, size_t n) {
+            auto r = c._begin + c.used;
+            c.used += n;
+            return r;
+        }
+
+        // Allocates a chunk from the allocator if there is one, and from the heap otherwise or if it fails
+        Chunk allocate_chunk(size_t size) {
+            if (allocator) {
+                auto n = size;
+                if (auto p = allocator->allocate(n))
+                    return { p, n, 0, true };
+            }
+#ifdef _WIN32
+            auto p = _aligned_malloc(size, arena_alignment);
+#else
+            void* p = nullptr;
+            if (posix_memalign(&p, arena_alignment, size) != 0) p = nullptr;
+#endif
+            if (!p) throw bad_alloc();
+            return { (uint8_t*)p, size, 0, false };
+        }
+
+        void free_chunk(Chunk& c) {
+            if (c.from_allocator) allocator->release(c._begin, c.size);
+#ifdef _WIN32
+            else _aligned_free(c._begin);
+#else
+            else free(c._begin);
+#endif
+        }
+    };
+}
@@ -0,0 +1,381 @@
+/*
+    BFAST Asynchronous Reader
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Reads arrays from BFAST files on a small pool of I/O threads, so that a render thread can request geometry as the
+    camera moves without ever blocking on the disk. Requests are queued by priority, and can be re-prioritized or
+    cancelled while they wait, so requests for things that are no longer visible do not hold up the ones that are.
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_reader.h"
+#include "bfast_parallel.h"
+
+#include <memory>
+#include <future>
+#include <condition_variable>
+
+namespace bfast
+{
+    // The state of an asynchronous read
+    enum ReadStatus
+    {
+        read_pending,
+        read_done,
+        read_cancelled,
+        read_failed,
+    };
+
+    struct AsyncRead;
+    typedef shared_ptr<AsyncRead> AsyncReadHandle;
+
+    // A request to read one array of one of the files of an AsyncReader
+    struct ReadRequest
+    {
+        size_t file = 0;
+        size_t array = 0;
+
+        // Where the array is read to. It must be at least as large as the array and stay valid until the read
+        // completes. If it is null the reader allocates an aligned buffer, which is owned by the read.
+        byte* buffer = nullptr;
+        size_t capacity = 0;
+
+        // Requests with higher priorities are read first. Requests with the same priority are read in the order they
+        // were submitted.
+        int priority = 0;
+
+        // Called on an I/O thread when the read completes or fails. When the read is cancelled it is called on the
+        // thread that cancelled it, from cancel, cancel_below, cancel_if, or the reader's destructor, after the reader's
+        // lock has been released. A callback that takes a lock must not be cancelled by a thread holding that lock.
+        // Must not throw.
+        function<void(AsyncRead&)> callback;
+    };
+
+    // An array that is being read, shared between the reader and the caller
+    struct AsyncRead
+    {
+        ReadRequest request;
+        ulong sequence = 0;
+        ReadStatus status = read_pending;
+
+        // The bytes of the array, once the read is done
+        ByteRange result = { nullptr, nullptr };
+
+        // Why the read failed
+        exception_ptr error;
+
+        // The buffer allocated by the reader when no buffer was given
+        AlignedBuffer owned;
+
+        // Set, with the reader's mutex held, when the read is taken from the pending list to be read
+        bool _taken = false;
+
+        // Becomes ready when the read completes. Throws the error if the read failed or was cancelled.
+        shared_future<ByteRange> future;
+        promise<ByteRange> _promise;
+    };
+
+    // The numbers of requests and reads handled by an AsyncReader
+    struct AsyncReadStats
+    {
+        size_t requests = 0;
+        size_t reads = 0;
+        size_t cancelled = 0;
+        size_t failed = 0;
+        ulong bytes_read = 0;
+    };
+
+    // Reads arrays of BFAST files in the background. Requests are taken from the queue in priority order by a fixed
+    // number of I/O threads. When a thread takes a request it also takes the other waiting requests for nearby
+    // arrays of the same file, and reads them all with one call. After a read, if nothing else is waiting for that
+    // file, the OS is asked to read ahead the bytes that follow, since views usually load neighbouring arrays next.
+    // Completion is reported through the request callback, the future of the read, or both.
+    struct AsyncReader
+    {
+        // Arrays separated by at most this many bytes are read with a single call
+        size_t gap_threshold = 64 << 10;
+
+        // The largest read made when coalescing requests. A single array larger than this is still read whole.
+        size_t max_read_size = 16 << 20;
+
+        // How many bytes after a read the OS is asked to read ahead, or zero to disable read-ahead
+        size_t read_ahead = 1 << 20;
+
+        vector<unique_ptr<BfastFile>> files;
+
+        // The reads waiting to start, in no particular order
+        vector<AsyncReadHandle> pending;
+        ulong next_sequence = 0;
+        bool stopping = false;
+        AsyncReadStats _stats;
+        mutable mutex _mutex;
+        condition_variable wake;
+        vector<thread> threads;
+
+        AsyncReader(size_t num_threads = 2) {
+            num_threads = max<size_t>(1, num_threads);
+            for (size_t i = 0; i < num_threads; ++i)
+                threads.emplace_back([this]() { run(); });
+        }
+
+        AsyncReader(const AsyncReader&) = delete;
+        AsyncReader& operator=(const AsyncReader&) = delete;
+
+        // Cancels the requests that are still waiting and waits for the reads in progress to finish
+        ~AsyncReader() {
+            {
+                lock_guard<mutex> lock(_mutex);
+                stopping = true;
+            }
+            cancel_if([](const AsyncRead&) { return true; });
+            wake.notify_all();
+            for (auto& t : threads)
+                t.join();
+        }
+
+        // Opens a BFAST file, returning the index used to refer to it in requests. Only the header and array offsets
+        // are read. Files must be added before requests for them are submitted.
+        size_t add_file(const string& path) {
+            unique_ptr<BfastFile> f(new BfastFile(path));
+            lock_guard<mutex> lock(_mutex);
+            files.push_back(move(f));
+            return files.size() - 1;
+        }
+
+        const BfastFile& file(size_t i) const {
+            lock_guard<mutex> lock(_mutex);
+            return *files.at(i);
+        }
+
+        // Queues a read, returning a handle that can be used to wait for it, re-prioritize it, or cancel it
+        AsyncReadHandle submit(const ReadRequest& request) {
+            return submit(vector<ReadRequest>{ request })[0];
+        }
+
+        // Queues a batch of reads at once, which lets them be coalesced
+        vector<AsyncReadHandle> submit(const vector<ReadRequest>& requests) {
+            vector<AsyncReadHandle> r;
+            {
+                lock_guard<mutex> lock(_mutex);
+                for (auto& request : requests) {
+                    auto& f = *files.at(request.file);
+                    auto& offset = f.offsets.at(request.array);
+                    auto size = offset._end - offset._begin;
+                    if (request.buffer && request.capacity < size)
+                        throw runtime_error("Buffer is too small for BFAST array " + to_string(request.array));
+                    auto read = make_shared<AsyncRead>();
+                    read->request = request;
+                    read->sequence = next_sequence++;
+                    read->future = read->_promise.get_future().share();
+                    if (!read->request.buffer) {
+                        read->owned.allocate(size);
+                        read->request.buffer = read->owned.data();
+                        read->request.capacity = size;
+                    }
+                    r.push_back(read);
+                }
+                pending.insert(pending.end(), r.begin(), r.end());
+                _stats.requests += r.size();
+            }
+            wake.notify_all();
+            return r;
+        }
+
+        // Changes the priority of a read that is still waiting. Returns false if it has already started.
+        bool set_priority(const AsyncReadHandle& read, int priority) {
+            lock_guard<mutex> lock(_mutex);
+            if (find(pending.begin(), pending.end(), read) == pending.end()) return false;
+            read->request.priority = priority;
+            return true;
+        }
+
+        // Cancels a read that is still waiting. Returns false if it has already started, in which case it completes
+        // normally.
+        bool cancel(const AsyncReadHandle& read) {
+            return cancel_if([&](const AsyncRead& r) { return &r == read.get(); }) > 0;
+        }
+
+        // Cancels all of the waiting reads with a priority lower than the given one, returning how many were cancelled.
+        // Useful for dropping stale requests when the view changes.
+        size_t cancel_below(int priority) {
+            return cancel_if([&](const AsyncRead& r) { return r.request.priority < priority; });
+        }
+
+        // Cancels all of the waiting reads that satisfy the predicate, returning how many were cancelled. The callbacks
+        // of the cancelled reads are called on this thread before it returns.
+        template<typename Predicate>
+        size_t cancel_if(Predicate predicate) {
+            vector<AsyncReadHandle> cancelled;
+            {
+                lock_guard<mutex> lock(_mutex);
+                auto split = stable_partition(pending.begin(), pending.end(), [&](const AsyncReadHandle& r) { return !predicate(*r); });
+                cancelled.assign(split, pending.end());
+                pending.erase(split, pending.end());
+                _stats.cancelled += cancelled.size();
+            }
+            for (auto& read : cancelled)
+                complete(*read, read_cancelled, make_exception_ptr(runtime_error("BFAST read was cancelled")));
+            return cancelled.size();
+        }
+
+        // The number of reads waiting to start
+        size_t num_pending() const {
+            lock_guard<mutex> lock(_mutex);
+            return pending.size();
+        }
+
+        AsyncReadStats stats() const {
+            lock_guard<mutex> lock(_mutex);
+            return _stats;
+        }
+
+        static ArrayOffset get_offset(const BfastFile& f, const AsyncRead& read) {
+            return f.offsets[read.request.array];
+        }
+
+        // Takes the waiting read with the highest priority, together with the waiting reads of the same file that
+        // lie close enough to it to be read with the same call. Must be called with the mutex held.
+        vector<AsyncReadHandle> take_batch() {
+            auto best = pending.begin();
+            for (auto it = pending.begin(); it != pending.end(); ++it)
+                if ((*it)->request.priority > (*best)->request.priority
+                    || ((*it)->request.priority == (*best)->request.priority && (*it)->sequence < (*best)->sequence))
+                    best = it;
+            auto first = *best;
+            auto& f = *files[first->request.file];
+
+            vector<AsyncReadHandle> candidates;
+            for (auto& read : pending)
+                if (read->request.file == first->request.file)
+                    candidates.push_back(read);
+            sort(candidates.begin(), candidates.end(), [&](const AsyncReadHandle& a, const AsyncReadHandle& b) {
+                return get_offset(f, *a)._begin < get_offset(f, *b)._begin;
+            });
+
+            // Grow the run outwards from the chosen read while the neighbours are close and the read stays small
+            auto center = (size_t)(find(candidates.begin(), candidates.end(), first) - candidates.begin());
+            auto lo = center, hi = center + 1;
+            auto begin = get_offset(f, *first)._begin, end = get_offset(f, *first)._end;
+            while (true) {
+                bool grew = false;
+                if (hi < candidates.size()) {
+                    auto o = get_offset(f, *candidates[hi]);
+                    if (o._begin <= end + gap_threshold && max(end, o._end) - begin <= max_read_size) {
+                        end = max(end, o._end);
+                        ++hi;
+                        grew = true;
+                    }
+                }
+                if (lo > 0) {
+                    auto o = get_offset(f, *candidates[lo - 1]);
+                    if (o._end + gap_threshold >= begin && end - min(begin, o._begin) <= max_read_size) {
+                        begin = min(begin, o._begin);
+                        --lo;
+                        grew = true;
+                    }
+                }
+                if (!grew) break;
+            }
+
+            vector<AsyncReadHandle> r(candidates.begin() + lo, candidates.begin() + hi);
+
+            // Batches can hold thousands of small arrays, so the taken reads are marked and removed in a single pass
+            for (auto& read : r)
+                read->_taken = true;
+            pending.erase(remove_if(pending.begin(), pending.end(), [](const AsyncReadHandle& read) { return read->_taken; }), pending.end());
+            return r;
+        }
+
+        // Reads a batch of arrays that all come from the same file. A single array is read straight into its buffer,
+        // several arrays are read with one call into a scratch buffer and then copied to their buffers.
+        void read_batch(const BfastFile& f, vector<AsyncReadHandle>& batch) {
+            ulong begin = numeric_limits<ulong>::max(), end = 0;
+            for (auto& read : batch) {
+                auto o = get_offset(f, *read);
+                begin = min(begin, o._begin);
+                end = max(end, o._end);
+            }
+            try {
+                AlignedBuffer scratch;
+                if (batch.size() == 1)
+                    f.file.read_at(batch[0]->request.buffer, (size_t)(end - begin), begin);
+                else {
+                    scratch.allocate((size_t)(end - begin));
+                    f.file.read_at(scratch.data(), scratch.size(), begin);
+                }
+                {
+                    lock_guard<mutex> lock(_mutex);
+                    _stats.reads++;
+                    _stats.bytes_read += end - begin;
+                }
+                for (auto& read : batch) {
+                    auto o = get_offset(f, *read);
+                    auto size = (size_t)(o._end - o._begin);
+                    if (batch.size() > 1 && size > 0)
+                        memcpy(read->request.buffer, scratch.data() + (o._begin - begin), size);
+                    read->result = { read->request.buffer, read->request.buffer + size };
+                    exception_ptr error;
+                    if (f.verify && !f.checksums.empty() && compute_checksum(read->result) != f.checksums[read->request.array])
+                        error = make_exception_ptr(runtime_error("Checksum mismatch for BFAST array " + to_string(read->request.array)));
+                    if (error) {
+                        lock_guard<mutex> lock(_mutex);
+                        _stats.failed++;
+                    }
+                    complete(*read, error ? read_failed : read_done, error);
+                }
+            }
+            catch (...) {
+                auto error = current_exception();
+                {
+                    lock_guard<mutex> lock(_mutex);
+                    _stats.failed += batch.size();
+                }
+                for (auto& read : batch)
+                    complete(*read, read_failed, error);
+            }
+        }
+
+        static void complete(AsyncRead& read, ReadStatus status, exception_ptr error) {
+            read.status = status;
+            read.error = error;
+            if (read.request.callback)
+                read.request.callback(read);
+            if (error)
+                read._promise.set_exception(error);
+            else
+                read._promise.set_value(read.result);
+        }
+
+        void run() {
+            while (true) {
+                vector<AsyncReadHandle> batch;
+                BfastFile* f = nullptr;
+                {
+                    unique_lock<mutex> lock(_mutex);
+                    wake.wait(lock, [&]() { return stopping || !pending.empty(); });
+                    if (pending.empty()) return;
+                    batch = take_batch();
+                    f = files[batch[0]->request.file].get();
+                }
+                read_batch(*f, batch);
+
+                // Let the OS read ahead while the caller decides what it needs next
+                if (read_ahead > 0) {
+                    ulong end = 0;
+                    for (auto& read : batch)
+                        end = max(end, get_offset(*f, *read)._end);
+                    bool idle;
+                    {
+                        lock_guard<mutex> lock(_mutex);
+                        idle = none_of(pending.begin(), pending.end(), [&](const AsyncReadHandle& r) { return files[r->request.file].get() == f; });
+                    }
+                    if (idle && end < f->header.data_end)
+                        f->file.read_ahead(end, min<ulong>(read_ahead, f->header.data_end - end));
+                }
+            }
+        }
+    };
+}
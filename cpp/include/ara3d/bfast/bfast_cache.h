@@ -0,0 +1,354 @@
+/*
+    BFAST Array Cache
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Keeps the arrays that are read from BFAST files in memory, within a fixed budget of bytes, so that arrays that are
+    used again and again are only read once. A single cache can be shared by all of the threads of a process and by
+    any number of open files.
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_reader.h"
+#include "bfast_hash.h"
+
+#include <memory>
+#include <future>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+
+namespace bfast
+{
+    // A BFAST file opened through an ArrayCache. Files with the same identity share cache entries whatever path they
+    // were opened with, while a file that was rewritten gets new ones. The file stays open while a handle to it exists.
+    struct CachedFile
+    {
+        BfastFile file;
+        FileIdentity identity;
+
+        explicit CachedFile(const string& path) : file(path), identity(file.file.identity()) { }
+    };
+
+    typedef shared_ptr<const CachedFile> CachedFileHandle;
+
+    // Identifies an array in the cache
+    struct CacheKey
+    {
+        FileIdentity file;
+        size_t array = 0;
+
+        bool operator==(const CacheKey& other) const { return array == other.array && file == other.file; }
+    };
+
+    struct CacheKeyHash
+    {
+        size_t operator()(const CacheKey& k) const {
+            ulong words[] = { k.file.device, k.file.inode, k.file.size, k.file.mtime, (ulong)k.array };
+            return (size_t)xxh64(words, sizeof(words));
+        }
+    };
+
+    // An array held by the cache. Entries are shared with the handles to them, and the cache only evicts an entry when
+    // no handle pins it.
+    struct CacheEntry
+    {
+        CacheKey key;
+        ulong size = 0;
+        LoadedArrays data;
+        ByteRange range = { nullptr, nullptr };
+
+        // The number of handles to the entry. Only incremented with the lock of its shard held, so an entry that the
+        // cache sees unpinned under that lock stays unpinned until it is evicted.
+        atomic<int> pins;
+
+        // Becomes ready once the array has been read, or holds the error if reading it failed. Threads that ask for
+        // an array while another thread is reading it wait for this instead of reading it again.
+        shared_future<void> ready;
+        promise<void> _loaded;
+
+        CacheEntry() : pins(0) { ready = _loaded.get_future().share(); }
+    };
+
+    // A pinned array of an ArrayCache. The array stays in memory, and its bytes stay valid, for as long as the handle
+    // exists. Handles can be moved but not copied.
+    struct CachedArray
+    {
+        shared_ptr<CacheEntry> entry;
+
+        CachedArray() { }
+        explicit CachedArray(shared_ptr<CacheEntry> entry) : entry(move(entry)) { }
+        CachedArray(CachedArray&& other) : entry(move(other.entry)) { }
+        CachedArray& operator=(CachedArray&& other) { release(); entry = move(other.entry); return *this; }
+        CachedArray(const CachedArray&) = delete;
+        CachedArray& operator=(const CachedArray&) = delete;
+        ~CachedArray() { release(); }
+
+        // Unpins the array, after which the cache may evict it
+        void release() {
+            if (!entry) return;
+            entry->pins--;
+            entry.reset();
+        }
+
+        bool valid() const { return entry != nullptr; }
+        ByteRange range() const { return entry->range; }
+        const byte* begin() const { return entry->range.begin(); }
+        const byte* end() const { return entry->range.end(); }
+        size_t size() const { return entry->range.size(); }
+    };
+
+    // The numbers of lookups, evictions, and bytes of an ArrayCache
+    struct CacheStats
+    {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+
+        // Arrays that were read for a caller but not kept, because the arrays that are pinned left no room for them
+        size_t uncached = 0;
+
+        size_t entries = 0;
+        ulong bytes = 0;
+        ulong budget = 0;
+    };
+
+    // A cache of BFAST arrays with a hard limit on the bytes it holds. Arrays are keyed by the identity of their file
+    // and their index, and are evicted least recently used first. Handles returned by get pin their array, and pinned
+    // arrays are never evicted, so when everything is pinned an array that does not fit is read for the caller
+    // without being cached.
+    // Arrays are spread over shards by the hash of their key, each with its own lock and LRU list. A lookup only
+    // locks the shard of its key, so lookups of different arrays rarely wait for each other and nothing takes a
+    // lock over the whole cache. The budget is shared through an atomic count of the bytes cached and being read.
+    struct ArrayCache
+    {
+        struct Shard
+        {
+            mutex _mutex;
+
+            // The most recently used entry is at the front
+            list<shared_ptr<CacheEntry>> lru;
+            unordered_map<CacheKey, list<shared_ptr<CacheEntry>>::iterator, CacheKeyHash> map;
+
+            size_t hits = 0;
+            size_t misses = 0;
+            size_t evictions = 0;
+        };
+
+        vector<unique_ptr<Shard>> shards;
+        atomic<ulong> _budget;
+        atomic<ulong> _bytes;
+        atomic<size_t> _uncached;
+
+        // The next shard to evict from
+        atomic<size_t> _hand;
+
+        explicit ArrayCache(ulong budget, size_t num_shards = 64) : _budget(budget), _bytes(0), _uncached(0), _hand(0) {
+            num_shards = max<size_t>(1, num_shards);
+            for (size_t i = 0; i < num_shards; ++i)
+                shards.emplace_back(new Shard());
+        }
+
+        ArrayCache(const ArrayCache&) = delete;
+        ArrayCache& operator=(const ArrayCache&) = delete;
+
+        // Opens a file whose arrays are to be read through the cache
+        static CachedFileHandle open(const string& path) {
+            return make_shared<const CachedFile>(path);
+        }
+
+        Shard& shard(const CacheKey& key) {
+            return *shards[CacheKeyHash()(key) % shards.size()];
+        }
+
+        // Returns an array, reading it from the file if it is not cached. The array is pinned until the handle is
+        // released. Throws if the array could not be read.
+        CachedArray get(const CachedFileHandle& f, size_t index) {
+            auto& offset = f->file.offsets.at(index);
+            CacheKey key;
+            key.file = f->identity;
+            key.array = index;
+            auto& s = shard(key);
+            shared_ptr<CacheEntry> found;
+            {
+                lock_guard<mutex> lock(s._mutex);
+                auto it = s.map.find(key);
+                if (it != s.map.end()) {
+                    s.hits++;
+                    s.lru.splice(s.lru.begin(), s.lru, it->second);
+                    found = pin(*it->second);
+                }
+                else {
+                    s.misses++;
+                }
+            }
+            if (found) return wait(move(found));
+
+            auto size = offset._end - offset._begin;
+            if (!reserve(size)) {
+                _uncached++;
+                return CachedArray(load(f, key, size));
+            }
+
+            auto entry = make_shared<CacheEntry>();
+            entry->key = key;
+            entry->size = size;
+            {
+                lock_guard<mutex> lock(s._mutex);
+                auto it = s.map.find(key);
+                if (it != s.map.end()) {
+                    // Another thread started reading the same array in the meantime
+                    found = pin(*it->second);
+                }
+                else {
+                    s.lru.push_front(entry);
+                    s.map.emplace(key, s.lru.begin());
+                    entry->pins++;
+                }
+            }
+            if (found) {
+                _bytes -= size;
+                return wait(move(found));
+            }
+            CachedArray r(entry);
+            try {
+                read(f, *entry);
+            }
+            catch (...) {
+                {
+                    lock_guard<mutex> lock(s._mutex);
+                    auto it = s.map.find(key);
+                    if (it != s.map.end() && *it->second == entry) {
+                        s.lru.erase(it->second);
+                        s.map.erase(it);
+                    }
+                }
+                _bytes -= size;
+                entry->_loaded.set_exception(current_exception());
+                throw;
+            }
+            entry->_loaded.set_value();
+            return r;
+        }
+
+        // Changes the budget, evicting arrays that are not pinned until the cache is within it
+        void set_budget(ulong budget) {
+            _budget = budget;
+            evict(budget);
+        }
+
+        // Evicts every array that is not pinned
+        void clear() {
+            evict(0);
+        }
+
+        ulong budget() const { return _budget.load(); }
+        ulong bytes() const { return _bytes.load(); }
+
+        CacheStats stats() {
+            CacheStats r;
+            for (auto& s : shards) {
+                lock_guard<mutex> lock(s->_mutex);
+                r.hits += s->hits;
+                r.misses += s->misses;
+                r.evictions += s->evictions;
+                r.entries += s->map.size();
+            }
+            r.uncached = _uncached.load();
+            r.bytes = _bytes.load();
+            r.budget = _budget.load();
+            return r;
+        }
+
+        // Pins an entry. Must be called with the lock of its shard held.
+        static shared_ptr<CacheEntry> pin(const shared_ptr<CacheEntry>& entry) {
+            entry->pins++;
+            return entry;
+        }
+
+        // Waits for an entry that may still be being read by another thread, rethrowing the error if that failed.
+        // Must be called without the lock of its shard held.
+        static CachedArray wait(shared_ptr<CacheEntry> entry) {
+            CachedArray r(move(entry));
+            r.entry->ready.get();
+            return r;
+        }
+
+        static void read(const CachedFileHandle& f, CacheEntry& entry) {
+            entry.data = f->file.read_array(entry.key.array);
+            entry.range = entry.data[0];
+        }
+
+        // Reads an array into an entry that is not part of the cache
+        static shared_ptr<CacheEntry> load(const CachedFileHandle& f, const CacheKey& key, ulong size) {
+            auto entry = make_shared<CacheEntry>();
+            entry->key = key;
+            entry->size = size;
+            entry->pins++;
+            read(f, *entry);
+            entry->_loaded.set_value();
+            return entry;
+        }
+
+        // Reserves room for an array, evicting arrays if needed. Returns false if there is not enough room even when
+        // every array that is not pinned has been evicted. The bytes are only added when they fit, so the count never
+        // goes over the budget, even for a moment.
+        bool reserve(ulong size) {
+            auto budget = _budget.load();
+            if (size > budget) return false;
+            while (true) {
+                auto current = _bytes.load();
+                while (current + size <= budget)
+                    if (_bytes.compare_exchange_weak(current, current + size))
+                        return true;
+                if (evict(budget - size) == 0 && _bytes.load() + size > budget)
+                    return false;
+            }
+        }
+
+        // Evicts arrays that are not pinned until the cache holds no more than the target. The least recently used
+        // array of each shard is taken in turn, which comes close to a single LRU order over the whole cache while
+        // only ever holding one shard lock. Stops once no shard has anything left to evict. Returns the number of
+        // arrays evicted.
+        size_t evict(ulong target) {
+            size_t evicted = 0, idle = 0;
+            while (_bytes.load() > target && idle < shards.size()) {
+                auto& s = *shards[_hand++ % shards.size()];
+
+                // Released after the lock, so the memory is freed outside of it
+                shared_ptr<CacheEntry> victim;
+                {
+                    lock_guard<mutex> lock(s._mutex);
+                    for (auto it = s.lru.end(); it != s.lru.begin(); ) {
+                        --it;
+                        if ((*it)->pins.load() != 0) continue;
+                        victim = *it;
+                        s.map.erase(victim->key);
+                        s.lru.erase(it);
+                        s.evictions++;
+                        break;
+                    }
+                }
+                if (victim) {
+                    _bytes -= victim->size;
+                    evicted++;
+                    idle = 0;
+                }
+                else {
+                    idle++;
+                }
+            }
+            return evicted;
+        }
+    };
+
+    // The cache shared by the whole process. Its budget starts at 1 GB and can be changed with set_budget.
+    // Declared inline rather than static, so that every translation unit gets the same cache.
+    inline ArrayCache& global_array_cache() {
+        static ArrayCache cache(1ull << 30);
+        return cache;
+    }
+}
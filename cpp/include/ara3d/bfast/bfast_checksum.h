@@ -0,0 +1,147 @@
+/*
+    BFAST Checksums
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    A BFAST can optionally carry a table with a checksum of each array, so that corrupted or truncated files are
+    detected instead of being read as garbage. The table is stored after data_end, at an aligned offset given by
+    the header extension. Readers that do not know about it never look past data_end, so they are unaffected.
+
+    The checksum table has the following layout:
+        * ChecksumTableHeader - magic number, hash algorithm, and number of arrays
+        * checksums - one 64-bit hash for each array, in the same order as the array offsets
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_hash.h"
+#include "bfast_parallel.h"
+
+#include <atomic>
+#include <memory>
+
+namespace bfast
+{
+    // Identifies a checksum table
+    const unsigned int CHECKSUM_MAGIC = 0xBFCC;
+
+    // Hash algorithms used for checksums
+    enum ChecksumAlgorithm {
+        checksum_xxh3 = 1,
+    };
+
+    // Precedes the checksums in a checksum table
+    struct alignas(8) ChecksumTableHeader {
+        ulong magic;
+        ulong algorithm;
+        ulong num_arrays;
+        ulong reserved;
+    };
+
+    // Computes the checksum of an array
+    inline ulong compute_checksum(const void* data, size_t n) {
+        return xxh3(data, n);
+    }
+
+    inline ulong compute_checksum(ByteRange range) {
+        return xxh3(range);
+    }
+
+    // Computes the checksum of each array, hashing different arrays on different threads
+    static vector<ulong> compute_checksums(const vector<ByteRange>& ranges, size_t num_threads = 0) {
+        vector<ulong> r(ranges.size());
+        parallel_for(ranges.size(), [&](size_t i) { r[i] = compute_checksum(ranges[i]); }, num_threads);
+        return r;
+    }
+
+    // Returns the bytes of a checksum table for the given checksums
+    static vector<byte> make_checksum_table(const vector<ulong>& checksums) {
+        ChecksumTableHeader h = { CHECKSUM_MAGIC, checksum_xxh3, checksums.size(), 0 };
+        vector<byte> r(sizeof(h) + checksums.size() * sizeof(ulong));
+        memcpy(r.data(), &h, sizeof(h));
+        if (!checksums.empty())
+            memcpy(r.data() + sizeof(h), checksums.data(), checksums.size() * sizeof(ulong));
+        return r;
+    }
+
+    // Checks that a checksum table header matches the BFAST it belongs to and fits in a file of the given size
+    static void validate_checksum_table(const ChecksumTableHeader& h, ulong position, size_t num_arrays, ulong size) {
+        if (h.magic != CHECKSUM_MAGIC) throw runtime_error("Invalid BFAST checksum table");
+        if (h.algorithm != checksum_xxh3) throw runtime_error("Unsupported BFAST checksum algorithm");
+        if (h.num_arrays != num_arrays) throw runtime_error("BFAST checksum table does not match the number of arrays");
+        if (num_arrays > (size - position - sizeof(h)) / sizeof(ulong)) throw runtime_error("BFAST checksum table is truncated");
+    }
+
+    // Returns the checksums stored in a BFAST blob, or an empty vector if it has none
+    static vector<ulong> get_checksums(ByteRange bytes, size_t num_arrays) {
+        auto position = get_header_extension(bytes).checksums;
+        if (position == 0) return {};
+        if (position > bytes.size() || bytes.size() - position < sizeof(ChecksumTableHeader)) throw runtime_error("BFAST checksum table is truncated");
+        ChecksumTableHeader h;
+        memcpy(&h, bytes.begin() + position, sizeof(h));
+        validate_checksum_table(h, position, num_arrays, bytes.size());
+        vector<ulong> r(num_arrays);
+        if (num_arrays > 0)
+            memcpy(r.data(), bytes.begin() + position + sizeof(h), num_arrays * sizeof(ulong));
+        return r;
+    }
+
+    // Reads the checksums stored in a BFAST file, or returns an empty vector if it has none
+    static vector<ulong> read_checksums(const File& file, size_t num_arrays) {
+        auto size = file.size();
+        if (size < array_offsets_start) return {};
+        HeaderExtension ext;
+        file.read_at(&ext, sizeof(ext), header_extension_offset);
+        if (ext.checksums == 0) return {};
+        if (ext.checksums > size || size - ext.checksums < sizeof(ChecksumTableHeader)) throw runtime_error("BFAST checksum table is truncated");
+        ChecksumTableHeader h;
+        file.read_at(&h, sizeof(h), ext.checksums);
+        validate_checksum_table(h, ext.checksums, num_arrays, size);
+        vector<ulong> r(num_arrays);
+        if (num_arrays > 0)
+            file.read_at(r.data(), num_arrays * sizeof(ulong), ext.checksums + sizeof(h));
+        return r;
+    }
+
+    // Verifies arrays against their checksums lazily, the first time each one is accessed, rather than hashing
+    // the whole file when it is opened. The result for each array is remembered, so later accesses are free.
+    // Safe to use from several threads: at worst two threads hash the same array at the same time.
+    struct ChecksumVerifier
+    {
+        enum State : uint8_t { unchecked, valid, invalid };
+
+        vector<ulong> checksums;
+        unique_ptr<atomic<uint8_t>[]> states;
+
+        ChecksumVerifier() { }
+        explicit ChecksumVerifier(vector<ulong> checksums) { reset(move(checksums)); }
+
+        void reset(vector<ulong> values) {
+            checksums = move(values);
+            states.reset(new atomic<uint8_t>[checksums.size()]);
+            for (size_t i = 0; i < checksums.size(); ++i)
+                states[i] = unchecked;
+        }
+
+        // Returns true if the file has checksums
+        bool enabled() const { return !checksums.empty(); }
+
+        // Returns true if the array matches its checksum, or if there are no checksums
+        bool check(size_t i, ByteRange data) {
+            if (!enabled()) return true;
+            if (i >= checksums.size()) throw runtime_error("Array index is out of range");
+            auto state = states[i].load(memory_order_acquire);
+            if (state == unchecked) {
+                state = compute_checksum(data) == checksums[i] ? valid : invalid;
+                states[i].store(state, memory_order_release);
+            }
+            return state == valid;
+        }
+
+        // Throws an exception if the array does not match its checksum
+        void verify(size_t i, ByteRange data) {
+            if (!check(i, data)) throw runtime_error("Checksum mismatch for BFAST array " + to_string(i));
+        }
+    };
+}
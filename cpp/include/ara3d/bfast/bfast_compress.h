@@ -0,0 +1,495 @@
+/*
+    BFAST Compression
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    A compressed BFAST has the same layout as a BFAST (header, array offsets, aligned arrays) but is identified by
+    COMPRESSED_MAGIC, so readers of plain BFASTs reject it instead of returning compressed bytes as array data.
+    Plain BFASTs are unaffected and stay zero-copy.
+
+    Each array is split into fixed size blocks which are compressed independently, so any sub-range of an array can be
+    decompressed without touching the rest of it. An encoded array is laid out as:
+        * header - a CompressedArrayHeader (32 bytes)
+        * blocks - the compressed blocks, one after the other, padded to 8 bytes at the end
+        * index - one ulong per block giving the end of the block relative to the start of the blocks
+    A block whose compressed size equals its decompressed size is stored uncompressed. The index is at the end so that
+    arrays can be written while they are being compressed.
+
+    The codec is an in-tree implementation of the LZ4 block format: a greedy hash-based match finder and a byte
+    oriented decoder, which trades compression ratio for speed.
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_writer.h"
+#include "bfast_parallel.h"
+
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+
+namespace bfast
+{
+    // Magic number for identifying a compressed BFAST
+    const unsigned int COMPRESSED_MAGIC = 0xBFAC;
+
+    // The default size of each decompressed block
+    static const size_t default_block_size = 256 << 10;
+
+    // Identifies the block codec of a compressed array
+    enum Codec
+    {
+        codec_none,
+        codec_lz4,
+    };
+
+    // Describes a compressed array, found at the start of its encoded bytes
+    struct CompressedArrayHeader {
+        ulong raw_size;     // The size of the array when decompressed
+        ulong block_size;   // The decompressed size of each block, except for the last which may be smaller
+        ulong num_blocks;   // The number of blocks, and of entries in the block index
+        ulong codec;        // How the blocks are compressed
+    };
+
+    // The largest size that compressing n bytes can produce
+    static size_t lz4_compress_bound(size_t n) {
+        return n + n / 255 + 16;
+    }
+
+    // Compresses n bytes in the LZ4 block format. Returns the compressed size, or zero if it does not fit in the capacity.
+    static size_t lz4_compress(const byte* src, size_t n, byte* dst, size_t capacity) {
+        const int hash_bits = 14;
+        const size_t min_match = 4;
+        const size_t last_literals = 5;
+        const size_t match_limit = 12;
+        const size_t max_offset = 65535;
+
+        auto read32 = [](const byte* p) { uint32_t r; memcpy(&r, p, 4); return r; };
+        auto hash = [](uint32_t v) { return (v * 2654435761u) >> (32 - hash_bits); };
+        auto dst_end = dst + capacity;
+        auto out = dst;
+
+        // Writes a sequence of literals followed by a match. A match length of zero ends the block.
+        auto emit = [&](const byte* literals, size_t num_literals, size_t offset, size_t match_length) {
+            if ((size_t)(dst_end - out) < num_literals + num_literals / 255 + match_length / 255 + 8)
+                return false;
+            auto token = out++;
+            *token = (byte)(min<size_t>(num_literals, 15) << 4);
+            if (num_literals >= 15) {
+                auto len = num_literals - 15;
+                for (; len >= 255; len -= 255) *out++ = 255;
+                *out++ = (byte)len;
+            }
+            memcpy(out, literals, num_literals);
+            out += num_literals;
+            if (match_length == 0)
+                return true;
+            *out++ = (byte)offset;
+            *out++ = (byte)(offset >> 8);
+            auto len = match_length - min_match;
+            *token |= (byte)min<size_t>(len, 15);
+            if (len >= 15) {
+                len -= 15;
+                for (; len >= 255; len -= 255) *out++ = 255;
+                *out++ = (byte)len;
+            }
+            return true;
+        };
+
+        size_t anchor = 0;
+        if (n > match_limit) {
+            vector<uint32_t> table(1 << hash_bits, 0);
+            size_t misses = 0;
+            for (size_t i = 0; i + match_limit < n; ) {
+                auto v = read32(src + i);
+                auto h = hash(v);
+                size_t candidate = table[h];
+                table[h] = (uint32_t)i;
+                if (candidate < i && i - candidate <= max_offset && read32(src + candidate) == v) {
+                    auto length = min_match;
+                    while (i + length + last_literals < n && src[candidate + length] == src[i + length])
+                        ++length;
+                    if (!emit(src + anchor, i - anchor, i - candidate, length))
+                        return 0;
+                    i += length;
+                    anchor = i;
+                    misses = 0;
+                }
+                else {
+                    // Skip faster through data that does not compress
+                    i += 1 + (misses++ >> 6);
+                }
+            }
+        }
+        if (!emit(src + anchor, n - anchor, 0, 0))
+            return 0;
+        return out - dst;
+    }
+
+    // Decompresses a block in the LZ4 block format, which must decompress to exactly dst_size bytes.
+    // Returns false if the data is malformed, without ever reading or writing out of bounds.
+    static bool lz4_decompress(const byte* src, size_t n, byte* dst, size_t dst_size) {
+        auto ip = src;
+        auto ip_end = src + n;
+        auto op = dst;
+        auto op_end = dst + dst_size;
+        auto read_length = [&](size_t& length) {
+            byte b;
+            do {
+                if (ip >= ip_end) return false;
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+            return true;
+        };
+        while (ip < ip_end) {
+            auto token = *ip++;
+            size_t num_literals = token >> 4;
+            if (num_literals == 15 && !read_length(num_literals)) return false;
+            if (num_literals > (size_t)(ip_end - ip) || num_literals > (size_t)(op_end - op)) return false;
+            // Short literal runs are copied with a fixed size copy when there is room, which is much cheaper
+            if (num_literals <= 16 && ip_end - ip >= 16 && op_end - op >= 16)
+                memcpy(op, ip, 16);
+            else
+                memcpy(op, ip, num_literals);
+            ip += num_literals;
+            op += num_literals;
+            if (ip == ip_end) break;
+
+            if (ip_end - ip < 2) return false;
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > (size_t)(op - dst)) return false;
+            size_t length = token & 15;
+            if (length == 15 && !read_length(length)) return false;
+            length += 4;
+            if (length > (size_t)(op_end - op)) return false;
+            auto match = op - offset;
+            if (offset >= 8 && (size_t)(op_end - op) >= length + 8) {
+                // Copy 8 bytes at a time, possibly past the end of the match, which is overwritten later 
+                auto end = op + length;
+                for (; op < end; op += 8, match += 8)
+                    memcpy(op, match, 8);
+                op = end;
+            }
+            else if (offset >= length) {
+                memcpy(op, match, length);
+                op += length;
+            }
+            else {
+                // Overlapping matches repeat the last offset bytes
+                for (size_t i = 0; i < length; ++i)
+                    *op++ = *match++;
+            }
+        }
+        return op == op_end;
+    }
+
+    // Compresses one block, returning its size in the output. Blocks that do not shrink are stored as is.
+    static size_t compress_block(const byte* src, size_t n, byte* dst) {
+        auto r = lz4_compress(src, n, dst, n - 1);
+        if (r > 0)
+            return r;
+        memcpy(dst, src, n);
+        return n;
+    }
+
+    // Returns the number of blocks an array of the given size is split into
+    static size_t compute_num_blocks(size_t raw_size, size_t block_size) {
+        return (raw_size + block_size - 1) / block_size;
+    }
+
+    // Compresses an array into its encoded form: header, compressed blocks, and block index
+    static vector<byte> compress_array(ByteRange data, size_t block_size = default_block_size) {
+        if (block_size == 0) throw runtime_error("Block size must be greater than zero");
+        CompressedArrayHeader h = { data.size(), block_size, compute_num_blocks(data.size(), block_size), codec_lz4 };
+        vector<byte> r(sizeof(h) + lz4_compress_bound(data.size()) + h.num_blocks * 16 + 8);
+        memcpy(r.data(), &h, sizeof(h));
+        auto blocks = r.data() + sizeof(h);
+        vector<ulong> ends;
+        ulong current = 0;
+        for (size_t pos = 0; pos < data.size(); pos += block_size) {
+            auto n = min(block_size, data.size() - pos);
+            current += compress_block(data.begin() + pos, n, blocks + current);
+            ends.push_back(current);
+        }
+        current = (current + 7) / 8 * 8;
+        if (!ends.empty())
+            memcpy(blocks + current, ends.data(), ends.size() * sizeof(ulong));
+        r.resize(sizeof(h) + current + ends.size() * sizeof(ulong));
+        return r;
+    }
+
+    // A view of an encoded array which can decompress any part of it
+    struct CompressedArray
+    {
+        CompressedArrayHeader header;
+        const byte* blocks;
+        const byte* index;
+
+        CompressedArray(ByteRange encoded) {
+            if (encoded.size() < sizeof(header)) throw runtime_error("Compressed array is too small");
+            memcpy(&header, encoded.begin(), sizeof(header));
+            if (header.codec != codec_lz4) throw runtime_error("Unsupported compression codec");
+            if (header.block_size == 0) throw runtime_error("Invalid compressed block size");
+            if (header.num_blocks != compute_num_blocks(header.raw_size, header.block_size)) throw runtime_error("Invalid number of compressed blocks");
+            if (header.num_blocks > (encoded.size() - sizeof(header)) / sizeof(ulong)) throw runtime_error("Compressed block index is out of range");
+            blocks = encoded.begin() + sizeof(header);
+            index = encoded.end() - header.num_blocks * sizeof(ulong);
+        }
+
+        size_t raw_size() const { return header.raw_size; }
+        size_t block_size() const { return header.block_size; }
+        size_t num_blocks() const { return header.num_blocks; }
+
+        // Where the compressed bytes of a block start and end, relative to the start of the blocks
+        ulong block_begin(size_t i) const { return i == 0 ? 0 : block_end(i - 1); }
+        ulong block_end(size_t i) const { ulong r; memcpy(&r, index + i * sizeof(ulong), sizeof(r)); return r; }
+
+        // The decompressed size of a block
+        size_t block_raw_size(size_t i) const { return min<size_t>(block_size(), raw_size() - i * block_size()); }
+
+        // Decompresses a whole block into memory of block_raw_size(i) bytes
+        void decompress_block(size_t i, byte* out) const {
+            auto begin = block_begin(i);
+            auto end = block_end(i);
+            if (end < begin || end > (ulong)(index - blocks)) throw runtime_error("Compressed block is out of range");
+            auto n = block_raw_size(i);
+            if (end - begin == n)
+                memcpy(out, blocks + begin, n);
+            else if (!lz4_decompress(blocks + begin, end - begin, out, n))
+                throw runtime_error("Compressed block is corrupt");
+        }
+
+        // Decompresses the bytes [begin, end) of the array. Only the blocks overlapping the range are decompressed.
+        void decompress(size_t begin, size_t end, byte* out) const {
+            if (begin > end || end > raw_size()) throw runtime_error("Range is outside of the compressed array");
+            if (begin == end) return;
+            vector<byte> tmp;
+            for (auto i = begin / block_size(); i * block_size() < end; ++i) {
+                auto block_start = i * block_size();
+                auto from = max(begin, block_start) - block_start;
+                auto to = min(end, block_start + block_raw_size(i)) - block_start;
+                if (from == 0 && to == block_raw_size(i)) {
+                    decompress_block(i, out);
+                }
+                else {
+                    tmp.resize(block_raw_size(i));
+                    decompress_block(i, tmp.data());
+                    memcpy(out, tmp.data() + from, to - from);
+                }
+                out += to - from;
+            }
+        }
+
+        // Decompresses the whole array
+        vector<byte> decompress() const {
+            vector<byte> r(raw_size());
+            decompress(0, r.size(), r.data());
+            return r;
+        }
+    };
+
+    // Returns true if the bytes hold a compressed BFAST rather than a plain one
+    static bool is_compressed(ByteRange bytes) {
+        return bytes.size() >= header_size && ((const Header*)bytes.begin())->magic == COMPRESSED_MAGIC;
+    }
+
+    // A compressed BFAST, read from memory or from a memory mapped file
+    struct CompressedBfast
+    {
+        MappedFile file;
+        vector<ByteRange> ranges;
+
+        CompressedBfast() { }
+        explicit CompressedBfast(ByteRange bytes) { open(bytes); }
+        explicit CompressedBfast(const string& path) { open(path); }
+
+        void open(ByteRange bytes) {
+            ranges = get_ranges(bytes, COMPRESSED_MAGIC);
+        }
+
+        void open(const string& path) {
+            file.open(path);
+            open(file.range());
+        }
+
+        size_t num_arrays() const { return ranges.size(); }
+        CompressedArray array(size_t i) const { return CompressedArray(ranges.at(i)); }
+        size_t raw_size(size_t i) const { return array(i).raw_size(); }
+
+        // Decompresses the bytes [begin, end) of an array
+        void decompress(size_t i, size_t begin, size_t end, byte* out) const { array(i).decompress(begin, end, out); }
+
+        // Decompresses a whole array
+        vector<byte> decompress(size_t i) const { return array(i).decompress(); }
+    };
+
+    // Compresses every array of a BFAST into the given buffers, returning a compressed BFAST that refers to them 
+    static Bfast compress_arrays(const Bfast& b, vector<vector<byte>>& encoded, size_t block_size = default_block_size) {
+        encoded.clear();
+        for (auto range : b.ranges)
+            encoded.push_back(compress_array(range, block_size));
+        Bfast r;
+        r.magic = COMPRESSED_MAGIC;
+        for (auto& e : encoded)
+            r.add_array(e.data(), e.data() + e.size());
+        return r;
+    }
+
+    // Compresses every array of a BFAST, returning the bytes of a compressed BFAST
+    static vector<byte> compress_to_bytes(const Bfast& b, size_t block_size = default_block_size) {
+        vector<vector<byte>> encoded;
+        return compress_arrays(b, encoded, block_size).copy_to_bytes();
+    }
+
+    // Compresses every array of a BFAST and writes it to a file
+    static void write_compressed_file(const Bfast& b, const string& path, size_t block_size = default_block_size) {
+        vector<vector<byte>> encoded;
+        write_file(compress_arrays(b, encoded, block_size), path);
+    }
+
+    // Compresses every array of a BFAST and writes it to a file, compressing blocks on several threads at once.
+    // The calling thread writes the compressed blocks in order, so the output is identical to write_compressed_file.
+    // At most max_in_flight compressed blocks are held in memory: threads wait when they get too far ahead of the writer.
+    static void write_compressed_file_parallel(const Bfast& b, const string& path, size_t block_size = default_block_size, size_t num_threads = 0, size_t max_in_flight = 0) {
+        if (block_size == 0) throw runtime_error("Block size must be greater than zero");
+        if (num_threads == 0) num_threads = default_num_threads();
+        if (max_in_flight == 0) max_in_flight = num_threads * 4;
+
+        struct Task { size_t array; size_t pos; size_t size; };
+        vector<Task> tasks;
+        for (size_t i = 0; i < b.ranges.size(); ++i)
+            for (size_t pos = 0; pos < b.ranges[i].size(); pos += block_size)
+                tasks.push_back({ i, pos, min(block_size, b.ranges[i].size() - pos) });
+
+        // Task k is compressed into slot k % max_in_flight, which is free once task k - max_in_flight is written
+        struct Slot { vector<byte> data; bool ready = false; };
+        vector<Slot> slots(max_in_flight);
+        mutex m;
+        condition_variable cv;
+        size_t next = 0;
+        size_t written = 0;
+        bool failed = false;
+        exception_ptr error;
+
+        auto fail = [&]() {
+            lock_guard<mutex> lock(m);
+            if (!error) error = current_exception();
+            failed = true;
+            cv.notify_all();
+        };
+
+        auto worker = [&]() {
+            try {
+                for (;;) {
+                    size_t k;
+                    {
+                        unique_lock<mutex> lock(m);
+                        cv.wait(lock, [&]() { return failed || next >= tasks.size() || next < written + max_in_flight; });
+                        if (failed || next >= tasks.size()) return;
+                        k = next++;
+                    }
+                    auto& t = tasks[k];
+                    vector<byte> out(t.size);
+                    out.resize(compress_block(b.ranges[t.array].begin() + t.pos, t.size, out.data()));
+                    lock_guard<mutex> lock(m);
+                    slots[k % max_in_flight].data = move(out);
+                    slots[k % max_in_flight].ready = true;
+                    cv.notify_all();
+                }
+            }
+            catch (...) {
+                fail();
+            }
+        };
+
+        vector<thread> threads;
+        for (size_t i = 0; i < num_threads; ++i)
+            threads.emplace_back(worker);
+
+        // On failure the partly written file is aborted, so a truncated file is never left behind looking valid
+        StreamingWriter w;
+        try {
+            w.open(path, b.ranges.size());
+            w.magic = COMPRESSED_MAGIC;
+            size_t k = 0;
+            for (size_t i = 0; i < b.ranges.size(); ++i) {
+                CompressedArrayHeader h = { b.ranges[i].size(), block_size, compute_num_blocks(b.ranges[i].size(), block_size), codec_lz4 };
+                w.begin_array();
+                w.append(&h, sizeof(h));
+                vector<ulong> ends;
+                ulong current = 0;
+                for (size_t j = 0; j < h.num_blocks; ++j, ++k) {
+                    vector<byte> data;
+                    {
+                        auto& slot = slots[k % max_in_flight];
+                        unique_lock<mutex> lock(m);
+                        cv.wait(lock, [&]() { return failed || slot.ready; });
+                        if (failed) break;
+                        data = move(slot.data);
+                        slot.ready = false;
+                        written++;
+                        cv.notify_all();
+                    }
+                    w.append(data.data(), data.size());
+                    current += data.size();
+                    ends.push_back(current);
+                }
+                if (failed) break;
+                w.append(zero_padding, (8 - current % 8) % 8);
+                w.append(ends.data(), ends.size() * sizeof(ulong));
+                w.end_array();
+            }
+            if (failed)
+                w.abort();
+            else
+                w.close();
+        }
+        catch (...) {
+            w.abort();
+            fail();
+        }
+
+        for (auto& t : threads)
+            t.join();
+        if (error)
+            rethrow_exception(error);
+    }
+
+    // Decompresses several arrays at once, spreading the blocks of all of them across threads. 
+    // Each thread decompresses straight into the output, so memory use is just the decompressed arrays.
+    static vector<vector<byte>> decompress_arrays_parallel(const CompressedBfast& c, const vector<size_t>& indices, size_t num_threads = 0) {
+        vector<CompressedArray> arrays;
+        vector<vector<byte>> r;
+        struct Task { size_t index; size_t block; };
+        vector<Task> tasks;
+        for (size_t i = 0; i < indices.size(); ++i) {
+            arrays.push_back(c.array(indices[i]));
+            r.emplace_back(arrays.back().raw_size());
+            for (size_t j = 0; j < arrays.back().num_blocks(); ++j)
+                tasks.push_back({ i, j });
+        }
+        parallel_for(tasks.size(), [&](size_t k) {
+            auto& a = arrays[tasks[k].index];
+            a.decompress_block(tasks[k].block, r[tasks[k].index].data() + tasks[k].block * a.block_size());
+        }, num_threads);
+        return r;
+    }
+
+    // Decompresses the bytes [begin, end) of an array using several threads
+    static void decompress_parallel(const CompressedArray& a, size_t begin, size_t end, byte* out, size_t num_threads = 0) {
+        if (begin > end || end > a.raw_size()) throw runtime_error("Range is outside of the compressed array");
+        if (begin == end) return;
+        auto first = begin / a.block_size();
+        auto last = (end - 1) / a.block_size();
+        parallel_for(last - first + 1, [&](size_t k) {
+            auto i = first + k;
+            auto block_start = i * a.block_size();
+            auto from = max(begin, block_start);
+            auto to = min(end, block_start + a.block_raw_size(i));
+            a.decompress(from, to, out + (from - begin));
+        }, num_threads);
+    }
+}
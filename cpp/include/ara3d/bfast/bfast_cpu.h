@@ -0,0 +1,69 @@
+/*
+    BFAST CPU Feature Detection
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Detects the SIMD instructions of the CPU at run time, so that hashing and byte swapping can use them without the
+    whole program having to be compiled for them. Functions that use instructions beyond the compiler's baseline
+    are marked with BFAST_TARGET, which lets GCC and Clang generate them without -mavx2 or -mssse3. GCC does not 
+    inline a function for one instruction set into a function for another, so entry points that run a loop over
+    such functions use BFAST_TARGET_FLATTEN, which inlines everything they call. MSVC accepts the intrinsics in any
+    function, so the attributes are empty there.
+
+    SIMD paths are only provided for x86-64, where SSE2 is always available. Other CPUs use the scalar code.
+*/
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BFAST_X64 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BFAST_TARGET(features) __attribute__((target(features)))
+#define BFAST_TARGET_FLATTEN(features) __attribute__((target(features), flatten))
+#else
+#define BFAST_TARGET(features)
+#define BFAST_TARGET_FLATTEN(features)
+#endif
+
+namespace bfast
+{
+    // The instruction set extensions that have optimized code paths
+    struct CpuFeatures
+    {
+        bool ssse3 = false;
+        bool avx2 = false;
+    };
+
+    inline CpuFeatures detect_cpu_features() {
+        CpuFeatures r;
+#if defined(BFAST_X64) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        auto max_leaf = info[0];
+        __cpuid(info, 1);
+        r.ssse3 = (info[2] & (1 << 9)) != 0;
+        // AVX2 also needs the OS to save the YMM registers, which is reported through OSXSAVE and XCR0
+        bool os_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+        if (max_leaf >= 7 && os_avx) {
+            __cpuidex(info, 7, 0);
+            r.avx2 = (info[1] & (1 << 5)) != 0;
+        }
+#elif defined(BFAST_X64)
+        __builtin_cpu_init();
+        r.ssse3 = __builtin_cpu_supports("ssse3") != 0;
+        r.avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+        return r;
+    }
+
+    // The features of the CPU the program is running on, detected once
+    inline const CpuFeatures& cpu_features() {
+        static const CpuFeatures r = detect_cpu_features();
+        return r;
+    }
+}
@@ -0,0 +1,251 @@
+/*
+    BFAST Endianness Conversion
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    A BFAST is written in the byte order of the machine that produced it. When it is read on a machine with the
+    opposite byte order the magic number reads as SWAPPED_MAGIC, or as the byte reversed MAGIC. The header and array
+    offsets can always be converted, because their layout is fixed. The arrays can only be converted if the size of
+    their values is known, for example from the attribute descriptors of a G3D (see SwappedG3d in g3d_swapped.h), so
+    they are converted on request.
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_cpu.h"
+
+#include <memory>
+#include <mutex>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
+
+namespace bfast
+{
+    static inline uint16_t byte_swap(uint16_t x) {
+#ifdef _MSC_VER
+        return _byteswap_ushort(x);
+#else
+        return __builtin_bswap16(x);
+#endif
+    }
+
+    static inline uint32_t byte_swap(uint32_t x) {
+#ifdef _MSC_VER
+        return _byteswap_ulong(x);
+#else
+        return __builtin_bswap32(x);
+#endif
+    }
+
+    static inline uint64_t byte_swap(uint64_t x) {
+#ifdef _MSC_VER
+        return _byteswap_uint64(x);
+#else
+        return __builtin_bswap64(x);
+#endif
+    }
+
+    // Returns true if the magic number identifies a BFAST written with the opposite byte order
+    static bool is_swapped_magic(ulong magic, ulong expected = MAGIC) {
+        return magic == SWAPPED_MAGIC || byte_swap(magic) == expected;
+    }
+
+    static void swap_header(Header& h) {
+        h.magic = byte_swap(h.magic);
+        h.data_start = byte_swap(h.data_start);
+        h.data_end = byte_swap(h.data_end);
+        h.num_arrays = byte_swap(h.num_arrays);
+    }
+
+    static void swap_offset(ArrayOffset& offset) {
+        offset._begin = byte_swap(offset._begin);
+        offset._end = byte_swap(offset._end);
+    }
+
+#ifdef BFAST_X64
+    // Returns the shuffle that reverses each value of the given size within a 16 byte lane: byte j comes from the 
+    // mirrored position in the same value 
+    static inline __m128i swap_shuffle_mask(size_t value_size) {
+        alignas(16) int8_t order[16];
+        for (int j = 0; j < 16; ++j)
+            order[j] = (int8_t)(j / value_size * value_size + (value_size - 1 - j % value_size));
+        return _mm_load_si128((const __m128i*)order);
+    }
+
+    // Swaps the values in whole 16 byte blocks with SSSE3 byte shuffles, returning the number of bytes done
+    BFAST_TARGET("ssse3") static size_t swap_values_ssse3(const byte* src, byte* dst, size_t n, size_t value_size) {
+        auto mask = swap_shuffle_mask(value_size);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            auto v = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(v, mask));
+        }
+        return i;
+    }
+
+    // Swaps the values in whole 32 byte blocks with AVX2 byte shuffles, returning the number of bytes done
+    BFAST_TARGET("avx2") static size_t swap_values_avx2(const byte* src, byte* dst, size_t n, size_t value_size) {
+        auto mask = _mm256_broadcastsi128_si256(swap_shuffle_mask(value_size));
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            auto v = _mm256_loadu_si256((const __m256i*)(src + i));
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(v, mask));
+        }
+        return i;
+    }
+#endif
+
+    // Reverses the byte order of each value in a block of memory. Values can be 1, 2, 4, 8, or 16 bytes.
+    // The source and destination may be the same, for converting in place, but must not otherwise overlap.
+    // Uses AVX2 or SSSE3 byte shuffles when the CPU has them, whatever the compiler options, and falls back to byte 
+    // swap instructions for the rest.
+    static void swap_values(const byte* src, byte* dst, size_t n, size_t value_size) {
+        if (value_size != 1 && value_size != 2 && value_size != 4 && value_size != 8 && value_size != 16)
+            throw runtime_error("Unsupported value size for byte swapping: " + to_string(value_size));
+        if (n % value_size != 0) throw runtime_error("Array size is not a multiple of the value size");
+        if (value_size == 1) {
+            if (src != dst) memcpy(dst, src, n);
+            return;
+        }
+
+        size_t i = 0;
+#ifdef BFAST_X64
+        auto& cpu = cpu_features();
+        if (cpu.avx2)
+            i = swap_values_avx2(src, dst, n, value_size);
+        if (cpu.ssse3)
+            i += swap_values_ssse3(src + i, dst + i, n - i, value_size);
+#endif
+
+        for (; i < n; i += value_size) {
+            switch (value_size) {
+            case 2: { uint16_t x; memcpy(&x, src + i, 2); x = byte_swap(x); memcpy(dst + i, &x, 2); break; }
+            case 4: { uint32_t x; memcpy(&x, src + i, 4); x = byte_swap(x); memcpy(dst + i, &x, 4); break; }
+            case 8: { uint64_t x; memcpy(&x, src + i, 8); x = byte_swap(x); memcpy(dst + i, &x, 8); break; }
+            case 16: {
+                uint64_t lo, hi;
+                memcpy(&lo, src + i, 8);
+                memcpy(&hi, src + i + 8, 8);
+                lo = byte_swap(lo);
+                hi = byte_swap(hi);
+                memcpy(dst + i, &hi, 8);
+                memcpy(dst + i + 8, &lo, 8);
+                break;
+            }
+            }
+        }
+    }
+
+    static void swap_journal_header(JournalHeader& j) {
+        j.magic = byte_swap(j.magic);
+        j.generation = byte_swap(j.generation);
+        j.num_arrays = byte_swap(j.num_arrays);
+        j.data_end = byte_swap(j.data_end);
+    }
+
+    // Reads the header and array offsets of a BFAST blob in native byte order, converting them if the blob was written
+    // with the opposite byte order. Returns true if it was. If the blob has been updated the offsets of the latest 
+    // generation are returned, as get_ranges does.
+    static bool get_native_offsets(ByteRange bytes, Header& h, vector<ArrayOffset>& offsets, ulong magic = MAGIC) {
+        if (bytes.size() < header_size) throw runtime_error("Data is smaller than a BFAST header");
+        memcpy(&h, bytes.begin(), sizeof(h));
+        auto swapped = is_swapped_magic(h.magic, magic);
+        ulong position = array_offsets_start;
+        if (swapped) {
+            swap_header(h);
+            // The legacy swapped magic number does not survive the conversion, so fix it up before validating
+            h.magic = magic;
+            validate_header(h, bytes.size(), magic);
+            // The journal position and header were written with the opposite byte order too
+            auto journal = byte_swap(get_header_extension(bytes).journal);
+            if (journal != 0) {
+                if (journal > bytes.size() || bytes.size() - journal < sizeof(JournalHeader)) throw runtime_error("BFAST journal is truncated");
+                JournalHeader j;
+                memcpy(&j, bytes.begin() + journal, sizeof(j));
+                swap_journal_header(j);
+                h = get_journal_header(h, j, journal, bytes.size());
+                position = journal + sizeof(JournalHeader);
+            }
+        }
+        else {
+            position = get_latest_offsets_position(bytes, h, magic);
+        }
+        offsets.resize(h.num_arrays);
+        if (h.num_arrays > 0)
+            memcpy(offsets.data(), bytes.begin() + position, h.num_arrays * sizeof(ArrayOffset));
+        for (auto& offset : offsets) {
+            if (swapped) swap_offset(offset);
+            validate_offset(h, offset);
+        }
+        return swapped;
+    }
+
+    // A memory mapped BFAST that can be read whatever byte order it was written in. Files in native byte order are
+    // read without copying, exactly like MappedBfast. For files in the opposite byte order the header and offsets are
+    // converted when the file is opened, and each array is converted the first time it is accessed, into an aligned
+    // buffer that is kept for later accesses. Arrays are never converted if they are never read.
+    // The size of the values in each array must be given with set_value_size or set_value_sizes before accessing them,
+    // otherwise arrays of a swapped file are returned as raw bytes.
+    struct SwappedBfast
+    {
+        MappedFile file;
+        Header header;
+        vector<ArrayOffset> offsets;
+        bool swapped = false;
+
+        // The size of each value in each array, one is for raw bytes
+        vector<size_t> value_sizes;
+
+        // The converted arrays, filled on demand
+        vector<AlignedBuffer> converted;
+        unique_ptr<once_flag[]> once;
+
+        SwappedBfast() { }
+        explicit SwappedBfast(const string& path, ulong magic = MAGIC) { open(path, magic); }
+
+        void open(const string& path, ulong magic = MAGIC) {
+            file.open(path);
+            swapped = get_native_offsets(file.range(), header, offsets, magic);
+            value_sizes.assign(offsets.size(), 1);
+            converted.clear();
+            converted.resize(offsets.size());
+            once.reset(new once_flag[offsets.size()]);
+        }
+
+        size_t num_arrays() const { return offsets.size(); }
+
+        // Returns the bytes of an array as stored in the file, without converting them
+        ByteRange raw(size_t i) const {
+            auto& offset = offsets.at(i);
+            return { file.begin() + offset._begin, file.begin() + offset._end };
+        }
+
+        // Sets the size of the values in an array, which determines how it is converted. Must be called before the
+        // array is first accessed.
+        void set_value_size(size_t i, size_t size) { value_sizes.at(i) = size; }
+
+        // Sets the size of the values of all of the arrays
+        void set_value_sizes(const vector<size_t>& sizes) {
+            if (sizes.size() != offsets.size()) throw runtime_error("Expected one value size per array");
+            value_sizes = sizes;
+        }
+
+        // Returns an array in native byte order. Safe to call concurrently from several threads.
+        ByteRange operator[](size_t i) {
+            auto r = raw(i);
+            // Empty arrays are returned as they are, so that they still point somewhere 
+            if (!swapped || value_sizes[i] == 1 || r.size() == 0)
+                return r;
+            call_once(once[i], [&]() {
+                AlignedBuffer buffer(r.size());
+                swap_values(r.begin(), buffer.data(), r.size(), value_sizes[i]);
+                converted[i] = move(buffer);
+            });
+            return { converted[i].begin(), converted[i].begin() + r.size() };
+        }
+    };
+}
@@ -0,0 +1,498 @@
+/*
+    BFAST over HTTP
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Reads selected arrays of a BFAST served by a plain HTTP file server, using range requests so that only the bytes
+    that are needed are downloaded. The header and array offsets are fetched with one request when the file is
+    opened, and the requested arrays are then fetched with as few range requests as possible, which are sent back to
+    back over a single keep-alive connection without waiting for each response.
+
+    Only plain http:// URLs are supported, and responses must have a Content-Length, which is what static file
+    servers send for files and ranges.
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_reader.h"
+#include "bfast_checksum.h"
+
+#include <cstring>
+#include <cctype>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
+
+namespace bfast
+{
+#ifdef _WIN32
+    typedef SOCKET socket_handle;
+    static const socket_handle invalid_socket = INVALID_SOCKET;
+#else
+    typedef int socket_handle;
+    static const socket_handle invalid_socket = -1;
+#endif
+
+    // Initializes the socket library, which is only needed on Windows
+    static void init_sockets() {
+#ifdef _WIN32
+        static struct Init {
+            Init() { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
+            ~Init() { WSACleanup(); }
+        } init;
+#endif
+    }
+
+    // A connected TCP socket with a receive buffer, for reading line based protocols
+    struct Socket
+    {
+        socket_handle _handle = invalid_socket;
+        vector<char> buffer;
+        size_t buffer_begin = 0;
+        size_t buffer_end = 0;
+
+        Socket() : buffer(64 << 10) { }
+        explicit Socket(socket_handle handle) : _handle(handle), buffer(64 << 10) { set_options(); }
+        Socket(const Socket&) = delete;
+        Socket& operator=(const Socket&) = delete;
+        ~Socket() { close(); }
+
+        bool is_open() const { return _handle != invalid_socket; }
+
+        void connect(const string& host, const string& port) {
+            close();
+            init_sockets();
+            addrinfo hints = {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* addresses = nullptr;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0 || !addresses)
+                throw runtime_error("Could not resolve host '" + host + "'");
+            for (auto a = addresses; a && !is_open(); a = a->ai_next) {
+                _handle = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                if (!is_open()) continue;
+                if (::connect(_handle, a->ai_addr, (int)a->ai_addrlen) != 0)
+                    close();
+            }
+            freeaddrinfo(addresses);
+            if (!is_open()) throw runtime_error("Could not connect to " + host + ":" + port);
+            set_options();
+        }
+
+        // Requests are small and sent back to back, so they should not wait to be combined into larger packets
+        void set_options() {
+            int one = 1;
+            setsockopt(_handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+            setsockopt(_handle, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&one, sizeof(one));
+#endif
+        }
+
+        void close() {
+            if (is_open()) {
+#ifdef _WIN32
+                closesocket(_handle);
+#else
+                ::close(_handle);
+#endif
+            }
+            _handle = invalid_socket;
+            buffer_begin = buffer_end = 0;
+        }
+
+        void send_all(const void* data, size_t n) {
+            auto p = (const char*)data;
+            while (n > 0) {
+#ifdef MSG_NOSIGNAL
+                auto sent = ::send(_handle, p, (int)min<size_t>(n, 1 << 30), MSG_NOSIGNAL);
+#else
+                auto sent = ::send(_handle, p, (int)min<size_t>(n, 1 << 30), 0);
+#endif
+                if (sent <= 0) throw runtime_error("Connection closed while sending");
+                p += sent;
+                n -= sent;
+            }
+        }
+
+        void send_all(const string& s) { send_all(s.data(), s.size()); }
+
+        // Receives more bytes into the buffer, returning false if the connection was closed
+        bool fill() {
+            if (buffer_begin == buffer_end)
+                buffer_begin = buffer_end = 0;
+            if (buffer_end == buffer.size()) {
+                memmove(buffer.data(), buffer.data() + buffer_begin, buffer_end - buffer_begin);
+                buffer_end -= buffer_begin;
+                buffer_begin = 0;
+            }
+            auto n = ::recv(_handle, buffer.data() + buffer_end, (int)(buffer.size() - buffer_end), 0);
+            if (n <= 0) return false;
+            buffer_end += n;
+            return true;
+        }
+
+        // Reads a line, without the line ending. Returns false if the connection was closed before a full line.
+        bool read_line(string& line) {
+            while (true) {
+                const char* begin = buffer.data() + buffer_begin;
+                const char* end = buffer.data() + buffer_end;
+                auto eol = (const char*)memchr(begin, '\n', end - begin);
+                if (eol) {
+                    line.assign(begin, eol);
+                    if (!line.empty() && line.back() == '\r') line.pop_back();
+                    buffer_begin += eol - begin + 1;
+                    return true;
+                }
+                if (buffer_end - buffer_begin == buffer.size()) throw runtime_error("Line is too long");
+                if (!fill()) return false;
+            }
+        }
+
+        // Reads exactly n bytes, which can be passed to a null destination to skip them
+        void read_exact(void* data, size_t n) {
+            auto p = (char*)data;
+            while (n > 0) {
+                if (buffer_begin == buffer_end) {
+                    // Large reads go straight into the destination rather than through the buffer
+                    if (p && n >= buffer.size()) {
+                        auto got = ::recv(_handle, p, (int)min<size_t>(n, 1 << 30), 0);
+                        if (got <= 0) throw runtime_error("Connection closed while receiving");
+                        p += got;
+                        n -= got;
+                        continue;
+                    }
+                    if (!fill()) throw runtime_error("Connection closed while receiving");
+                }
+                auto chunk = min(n, buffer_end - buffer_begin);
+                if (p) {
+                    memcpy(p, buffer.data() + buffer_begin, chunk);
+                    p += chunk;
+                }
+                buffer_begin += chunk;
+                n -= chunk;
+            }
+        }
+    };
+
+    // The parts of an http:// URL
+    struct Url
+    {
+        string host;
+        string port = "80";
+        string path = "/";
+
+        static Url parse(const string& url) {
+            const string scheme = "http://";
+            if (url.compare(0, scheme.size(), scheme) != 0) throw runtime_error("Only http:// URLs are supported: " + url);
+            Url r;
+            auto rest = url.substr(scheme.size());
+            auto slash = rest.find('/');
+            if (slash != string::npos) {
+                r.path = rest.substr(slash);
+                rest = rest.substr(0, slash);
+            }
+            auto colon = rest.rfind(':');
+            if (colon != string::npos && rest.find(']', colon) == string::npos) {
+                r.port = rest.substr(colon + 1);
+                rest = rest.substr(0, colon);
+            }
+            if (rest.size() >= 2 && rest.front() == '[' && rest.back() == ']')
+                rest = rest.substr(1, rest.size() - 2);
+            r.host = rest;
+            if (r.host.empty()) throw runtime_error("URL has no host: " + url);
+            return r;
+        }
+    };
+
+    // The status and the headers that matter for range requests of an HTTP response
+    struct HttpResponse
+    {
+        int status = 0;
+        ulong content_length = 0;
+        bool has_content_length = false;
+        bool keep_alive = true;
+
+        // From the Content-Range header of a 206 response
+        ulong range_begin = 0;
+        ulong total_size = 0;
+        bool has_total_size = false;
+    };
+
+    // Returns true if a header line has the given name, ignoring case, and stores its value
+    static bool get_header_value(const string& line, const char* name, string& value) {
+        auto colon = line.find(':');
+        if (colon == string::npos || colon != strlen(name)) return false;
+        for (size_t i = 0; i < colon; ++i)
+            if (tolower((unsigned char)line[i]) != tolower((unsigned char)name[i])) return false;
+        auto begin = line.find_first_not_of(" \t", colon + 1);
+        value = begin == string::npos ? string() : line.substr(begin);
+        return true;
+    }
+
+    // Reads the status line and headers of a response, leaving the body to be read
+    static HttpResponse read_response_head(Socket& s) {
+        HttpResponse r;
+        string line;
+        if (!s.read_line(line)) throw runtime_error("Connection closed before the response");
+        if (line.compare(0, 5, "HTTP/") != 0 || line.size() < 12) throw runtime_error("Invalid HTTP status line: " + line);
+        r.status = stoi(line.substr(9, 3));
+        if (line.compare(0, 8, "HTTP/1.0") == 0) r.keep_alive = false;
+        while (true) {
+            if (!s.read_line(line)) throw runtime_error("Connection closed in the response headers");
+            if (line.empty()) break;
+            string value;
+            if (get_header_value(line, "Content-Length", value)) {
+                r.content_length = stoull(value);
+                r.has_content_length = true;
+            }
+            else if (get_header_value(line, "Connection", value)) {
+                for (auto& c : value) c = (char)tolower((unsigned char)c);
+                if (value == "close") r.keep_alive = false;
+                if (value == "keep-alive") r.keep_alive = true;
+            }
+            else if (get_header_value(line, "Content-Range", value)) {
+                // bytes <begin>-<end>/<total>
+                auto space = value.find(' ');
+                auto dash = value.find('-', space);
+                auto slash = value.find('/', dash);
+                if (space != string::npos && dash != string::npos) r.range_begin = stoull(value.substr(space + 1, dash - space - 1));
+                if (slash != string::npos && value.compare(slash + 1, string::npos, "*") != 0) {
+                    r.total_size = stoull(value.substr(slash + 1));
+                    r.has_total_size = true;
+                }
+            }
+            else if (get_header_value(line, "Transfer-Encoding", value) && value != "identity") {
+                throw runtime_error("Unsupported transfer encoding: " + value);
+            }
+        }
+        if (!r.has_content_length) throw runtime_error("HTTP response has no Content-Length");
+        return r;
+    }
+
+    // The numbers of bytes and requests used to fetch arrays over HTTP
+    struct HttpStats
+    {
+        ulong bytes_downloaded = 0;
+        size_t requests = 0;
+        size_t connections = 0;
+    };
+
+    // A BFAST served over HTTP, read with range requests
+    struct HttpBfast
+    {
+        Url url;
+        Socket socket;
+        Header header;
+        vector<ArrayOffset> offsets;
+        vector<ulong> checksums;
+        ulong file_size = 0;
+        HttpStats stats;
+
+        // When true, and the file has checksums, every array that is read is checked against its checksum
+        bool verify = true;
+
+        // The number of requests sent before waiting for the first response. Keeps the connection busy without
+        // piling up more requests than a server is willing to queue.
+        size_t max_in_flight = 16;
+
+        // How many bytes the first request asks for. Enough for the header, the offsets of about 4000 arrays, and
+        // often the checksums too, so opening a file usually takes a single request.
+        size_t initial_request_size = 64 << 10;
+
+        HttpBfast() { }
+        explicit HttpBfast(const string& url) { open(url); }
+
+        // Fetches the header and array offsets, following the journal of updated files, and the checksum table
+        void open(const string& address) {
+            url = Url::parse(address);
+            socket.close();
+            offsets.clear();
+            checksums.clear();
+
+            auto first = fetch(0, initial_request_size);
+            if (first.size() < header_size) throw runtime_error("Data is smaller than a BFAST header");
+            memcpy(&header, first.data(), sizeof(header));
+            validate_header(header, file_size);
+            HeaderExtension ext = {};
+            if (first.size() >= array_offsets_start)
+                memcpy(&ext, first.data() + header_extension_offset, sizeof(ext));
+
+            // The journal and checksum table are appended to the end of the file, so when they are past the first
+            // request and the tail holding them is small, one more request fetches both
+            ulong tail_begin = file_size;
+            if (ext.journal != 0 && ext.journal < tail_begin) tail_begin = ext.journal;
+            if (ext.checksums != 0 && ext.checksums < tail_begin) tail_begin = ext.checksums;
+            vector<byte> tail;
+            if (tail_begin >= first.size() && tail_begin < file_size && file_size - tail_begin <= 16 * (ulong)initial_request_size)
+                tail = fetch(tail_begin, file_size - tail_begin);
+
+            // Returns bytes of the file, from what has been fetched already if possible
+            auto get = [&](ulong begin, ulong n) {
+                if (begin + n <= first.size())
+                    return vector<byte>(first.begin() + (size_t)begin, first.begin() + (size_t)(begin + n));
+                if (!tail.empty() && begin >= tail_begin && begin + n <= tail_begin + tail.size())
+                    return vector<byte>(tail.begin() + (size_t)(begin - tail_begin), tail.begin() + (size_t)(begin - tail_begin + n));
+                return fetch(begin, n);
+            };
+
+            auto h = header;
+            ulong position = array_offsets_start;
+            if (ext.journal != 0) {
+                if (ext.journal > file_size || file_size - ext.journal < sizeof(JournalHeader)) throw runtime_error("BFAST journal is truncated");
+                auto bytes = get(ext.journal, sizeof(JournalHeader));
+                JournalHeader j;
+                memcpy(&j, bytes.data(), sizeof(j));
+                h = get_journal_header(h, j, ext.journal, file_size);
+                position = ext.journal + sizeof(JournalHeader);
+            }
+            offsets.resize(h.num_arrays);
+            if (!offsets.empty()) {
+                auto bytes = get(position, offsets.size() * sizeof(ArrayOffset));
+                memcpy(offsets.data(), bytes.data(), bytes.size());
+            }
+            for (auto& offset : offsets)
+                validate_offset(h, offset);
+            header = h;
+
+            if (ext.checksums != 0) {
+                if (ext.checksums > file_size || file_size - ext.checksums < sizeof(ChecksumTableHeader)) throw runtime_error("BFAST checksum table is truncated");
+                ChecksumTableHeader t;
+                auto bytes = get(ext.checksums, sizeof(t) + offsets.size() * sizeof(ulong));
+                memcpy(&t, bytes.data(), sizeof(t));
+                validate_checksum_table(t, ext.checksums, offsets.size(), file_size);
+                checksums.resize(offsets.size());
+                if (!checksums.empty())
+                    memcpy(checksums.data(), bytes.data() + sizeof(t), checksums.size() * sizeof(ulong));
+            }
+        }
+
+        size_t num_arrays() const { return offsets.size(); }
+
+        // Fetches a range of the file with a single request. The returned bytes may be fewer than asked for if the
+        // file ends first.
+        vector<byte> fetch(ulong begin, ulong n) {
+            vector<byte> r;
+            fetch_ranges({ { begin, begin + n } }, [&](size_t, const HttpResponse& response, ulong offset, ulong size) {
+                r.resize((size_t)size);
+                socket.read_exact(r.data(), (size_t)size);
+                (void)response; (void)offset;
+            });
+            return r;
+        }
+
+        // Reads just the requested arrays. Arrays separated by no more than gap_threshold bytes are fetched with a
+        // single range request. Larger gaps are worth skipping, since the requests are pipelined and an extra
+        // request costs little more than its headers.
+        LoadedArrays read_arrays(const vector<size_t>& indices, size_t gap_threshold = 64 << 10) {
+            LoadedArrays r;
+            r.ranges.resize(indices.size());
+            auto runs = coalesce_reads(offsets, indices, gap_threshold);
+            vector<ArrayOffset> ranges;
+            for (auto& run : runs) {
+                ranges.push_back({ run._begin, run._end });
+                r.buffers.emplace_back(run.size());
+            }
+            fetch_ranges(ranges, [&](size_t i, const HttpResponse& response, ulong offset, ulong size) {
+                if (offset != runs[i]._begin || size != runs[i].size())
+                    throw runtime_error("Server returned a different range than requested from " + url.path);
+                (void)response;
+                socket.read_exact(r.buffers[i].data(), (size_t)size);
+                r.bytes_read += size;
+                r.num_reads++;
+            });
+
+            vector<const byte*> starts(offsets.size(), empty_array_data());
+            for (size_t i = 0; i < runs.size(); ++i)
+                for (auto a : runs[i].arrays)
+                    starts[a] = r.buffers[i].data() + (offsets[a]._begin - runs[i]._begin);
+            for (size_t i = 0; i < indices.size(); ++i) {
+                auto begin = starts[indices[i]];
+                auto size = offsets[indices[i]]._end - offsets[indices[i]]._begin;
+                r.ranges[i] = { begin, begin + size };
+                if (verify && !checksums.empty() && compute_checksum(r.ranges[i]) != checksums[indices[i]])
+                    throw runtime_error("Checksum mismatch for BFAST array " + to_string(indices[i]));
+            }
+            return r;
+        }
+
+        LoadedArrays read_array(size_t index) {
+            return read_arrays({ index });
+        }
+
+        // Sends a range request for each of the ranges over the keep-alive connection, up to max_in_flight at a time,
+        // and calls on_body(i, response, offset, size) for each response in order, which must read the body from the
+        // socket. If the server closes the connection the requests that were not answered are sent again on a new one.
+        // A server that does not support ranges answers with the whole file, which is skipped to the requested part.
+        template<typename F>
+        void fetch_ranges(const vector<ArrayOffset>& ranges, F on_body) {
+            size_t next_to_send = 0, next_to_receive = 0;
+            size_t retries = 0;
+            while (next_to_receive < ranges.size()) {
+                if (!socket.is_open()) {
+                    socket.connect(url.host, url.port);
+                    stats.connections++;
+                    next_to_send = next_to_receive;
+                }
+                try {
+                    // Keep up to max_in_flight requests outstanding
+                    string requests;
+                    for (; next_to_send < ranges.size() && next_to_send < next_to_receive + max(size_t(1), max_in_flight); ++next_to_send) {
+                        requests += "GET " + url.path + " HTTP/1.1\r\nHost: " + url.host + "\r\nRange: bytes="
+                            + to_string(ranges[next_to_send]._begin) + "-" + to_string(ranges[next_to_send]._end - 1) + "\r\n\r\n";
+                        stats.requests++;
+                    }
+                    if (!requests.empty())
+                        socket.send_all(requests);
+
+                    auto response = read_response_head(socket);
+                    auto& range = ranges[next_to_receive];
+                    if (response.status == 206) {
+                        if (response.has_total_size) file_size = response.total_size;
+                        stats.bytes_downloaded += response.content_length;
+                        on_body(next_to_receive, response, response.range_begin, response.content_length);
+                    }
+                    else if (response.status == 200) {
+                        // The server ignored the range, so take the requested part of the whole file
+                        file_size = response.content_length;
+                        stats.bytes_downloaded += response.content_length;
+                        auto begin = min(range._begin, response.content_length);
+                        auto end = min(range._end, response.content_length);
+                        socket.read_exact(nullptr, (size_t)begin);
+                        on_body(next_to_receive, response, begin, end - begin);
+                        socket.read_exact(nullptr, (size_t)(response.content_length - end));
+                    }
+                    else if (response.status == 416) {
+                        socket.read_exact(nullptr, (size_t)response.content_length);
+                        on_body(next_to_receive, response, range._begin, 0);
+                    }
+                    else {
+                        throw runtime_error("HTTP request for " + url.path + " failed with status " + to_string(response.status));
+                    }
+                    next_to_receive++;
+                    retries = 0;
+                    if (!response.keep_alive)
+                        socket.close();
+                }
+                catch (const runtime_error&) {
+                    // A keep-alive connection can be closed by the server at any time, so try again once on a
+                    // fresh connection before giving up
+                    if (!socket.is_open() || retries++ > 0) throw;
+                    socket.close();
+                }
+            }
+        }
+    };
+}
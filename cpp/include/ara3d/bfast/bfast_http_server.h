@@ -0,0 +1,241 @@
+/*
+    BFAST HTTP Test Server
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    A minimal static file server that supports the parts of HTTP/1.1 that HttpBfast relies on: GET and HEAD,
+    single range requests, and keep-alive connections with pipelined requests. It stands in for a real file server
+    when testing and measuring range reads on a local machine. It is not meant to face a network.
+*/
+#pragma once
+
+#include "bfast_http.h"
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+namespace bfast
+{
+    // Serves the files in a directory over HTTP on a background thread, with a thread for each connection
+    struct HttpFileServer
+    {
+        string root;
+        socket_handle listener = invalid_socket;
+        unsigned short _port = 0;
+        thread accept_thread;
+        atomic<bool> stopping;
+
+        // The open connections, so that stopping the server can close them
+        vector<socket_handle> connections;
+        vector<thread> threads;
+        mutex _mutex;
+
+        // The number of requests answered and body bytes sent
+        atomic<size_t> requests;
+        atomic<ulong> bytes_sent;
+
+        // When false the Range header is ignored and whole files are sent, like a server without range support
+        atomic<bool> ranges;
+
+        // When not zero, each connection is closed without an answer once this many requests have been answered on
+        // it, even if more were pipelined, like a server that drops idle or busy keep-alive connections
+        atomic<size_t> drop_after;
+
+        HttpFileServer() : stopping(false), requests(0), bytes_sent(0), ranges(true), drop_after(0) { }
+        HttpFileServer(const string& root, unsigned short port = 0) : HttpFileServer() { start(root, port); }
+        HttpFileServer(const HttpFileServer&) = delete;
+        HttpFileServer& operator=(const HttpFileServer&) = delete;
+        ~HttpFileServer() { stop(); }
+
+        // The port the server listens on, which is chosen by the OS if zero was given to start
+        unsigned short port() const { return _port; }
+
+        string url(const string& path) const { return "http://127.0.0.1:" + to_string(_port) + "/" + path; }
+
+        // Starts listening on the loopback address
+        void start(const string& directory, unsigned short port = 0) {
+            stop();
+            init_sockets();
+            root = directory;
+            stopping = false;
+            listener = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (listener == invalid_socket) throw runtime_error("Could not create a socket");
+            int one = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(port);
+            if (::bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, 64) != 0) {
+                close_socket(listener);
+                throw runtime_error("Could not listen on port " + to_string(port));
+            }
+            socklen_t length = sizeof(address);
+            getsockname(listener, (sockaddr*)&address, &length);
+            _port = ntohs(address.sin_port);
+            // The thread gets its own copy of the handle, since stop resets the member while it is running
+            auto s = listener;
+            accept_thread = thread([this, s]() { accept_connections(s); });
+        }
+
+        // Stops accepting connections, closes the open ones, and waits for all of the threads to finish
+        void stop() {
+            if (listener == invalid_socket) return;
+            stopping = true;
+            close_socket(listener);
+            if (accept_thread.joinable())
+                accept_thread.join();
+            vector<thread> finished;
+            {
+                lock_guard<mutex> lock(_mutex);
+                for (auto s : connections)
+                    shutdown_socket(s);
+                finished.swap(threads);
+            }
+            for (auto& t : finished)
+                t.join();
+        }
+
+        static void shutdown_socket(socket_handle s) {
+#ifdef _WIN32
+            ::shutdown(s, SD_BOTH);
+#else
+            ::shutdown(s, SHUT_RDWR);
+#endif
+        }
+
+        static void close_socket(socket_handle& s) {
+            if (s == invalid_socket) return;
+            shutdown_socket(s);
+#ifdef _WIN32
+            closesocket(s);
+#else
+            ::close(s);
+#endif
+            s = invalid_socket;
+        }
+
+        void accept_connections(socket_handle listening) {
+            while (!stopping) {
+                auto s = ::accept(listening, nullptr, nullptr);
+                if (s == invalid_socket) {
+                    if (stopping) return;
+                    continue;
+                }
+                lock_guard<mutex> lock(_mutex);
+                connections.push_back(s);
+                threads.emplace_back([this, s]() {
+                    Socket socket(s);
+                    try {
+                        serve(socket);
+                    }
+                    catch (const exception&) {
+                        // The client went away, which ends the connection
+                    }
+                    // Forget the handle before the socket closes it, since the OS may reuse it right away
+                    lock_guard<mutex> lock(_mutex);
+                    connections.erase(find(connections.begin(), connections.end(), s));
+                });
+            }
+        }
+
+        // Parses the value of a Range header for a file of the given size. Returns false if there is no usable
+        // single range, in which case the whole file is sent.
+        static bool parse_range(const string& value, ulong size, ulong& begin, ulong& end) {
+            if (value.compare(0, 6, "bytes=") != 0 || value.find(',') != string::npos) return false;
+            auto spec = value.substr(6);
+            auto dash = spec.find('-');
+            if (dash == string::npos) return false;
+            auto first = spec.substr(0, dash), last = spec.substr(dash + 1);
+            if (first.empty() && last.empty()) return false;
+            if (first.empty()) {
+                // The last n bytes
+                auto n = min<ulong>(stoull(last), size);
+                begin = size - n;
+                end = size;
+            }
+            else {
+                begin = stoull(first);
+                end = last.empty() ? size : min<ulong>(stoull(last) + 1, size);
+            }
+            return true;
+        }
+
+        // Answers requests on a connection until the client closes it or asks for it to be closed
+        void serve(Socket& socket) {
+            string line;
+            size_t answered = 0;
+            while (!stopping && socket.read_line(line)) {
+                if (line.empty()) continue;
+                auto space1 = line.find(' ');
+                auto space2 = line.find(' ', space1 + 1);
+                if (space1 == string::npos || space2 == string::npos) return;
+                auto method = line.substr(0, space1);
+                auto target = line.substr(space1 + 1, space2 - space1 - 1);
+                bool keep_alive = line.compare(space2 + 1, string::npos, "HTTP/1.0") != 0;
+
+                string range, value;
+                while (socket.read_line(line) && !line.empty()) {
+                    if (get_header_value(line, "Range", value)) range = value;
+                    if (get_header_value(line, "Connection", value)) {
+                        for (auto& c : value) c = (char)tolower((unsigned char)c);
+                        if (value == "close") keep_alive = false;
+                        if (value == "keep-alive") keep_alive = true;
+                    }
+                }
+                if (drop_after != 0 && answered++ == drop_after) return;
+                requests++;
+
+                auto path = target.substr(0, target.find('?'));
+                File file;
+                bool found = (method == "GET" || method == "HEAD") && path.find("..") == string::npos;
+                if (found) {
+                    try { file.open(root + path, file_read); }
+                    catch (const runtime_error&) { found = false; }
+                }
+                string head;
+                if (!found) {
+                    head = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n";
+                    respond(socket, head, keep_alive, file, 0, 0, false);
+                    if (!keep_alive) return;
+                    continue;
+                }
+
+                auto size = file.size();
+                ulong begin = 0, end = size;
+                if (ranges && parse_range(range, size, begin, end)) {
+                    if (begin >= size || begin >= end) {
+                        head = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" + to_string(size) + "\r\nContent-Length: 0\r\n";
+                        begin = end = 0;
+                    }
+                    else {
+                        head = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + to_string(begin) + "-" + to_string(end - 1) + "/" + to_string(size)
+                            + "\r\nContent-Length: " + to_string(end - begin) + "\r\n";
+                    }
+                }
+                else {
+                    head = "HTTP/1.1 200 OK\r\nContent-Length: " + to_string(size) + "\r\n";
+                }
+                if (ranges) head += "Accept-Ranges: bytes\r\n";
+                head += "Content-Type: application/octet-stream\r\n";
+                respond(socket, head, keep_alive, file, begin, end, method == "GET");
+                if (!keep_alive) return;
+            }
+        }
+
+        void respond(Socket& socket, string head, bool keep_alive, const File& file, ulong begin, ulong end, bool body) {
+            head += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+            socket.send_all(head);
+            if (!body) return;
+            vector<byte> buffer((size_t)min<ulong>(end - begin, 1 << 20));
+            for (auto position = begin; position < end; ) {
+                auto n = (size_t)min<ulong>(buffer.size(), end - position);
+                file.read_at(buffer.data(), n, position);
+                socket.send_all(buffer.data(), n);
+                position += n;
+                bytes_sent += n;
+            }
+        }
+    };
+}
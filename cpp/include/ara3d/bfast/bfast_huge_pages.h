@@ -0,0 +1,75 @@
+/*
+    BFAST Huge Page Arenas
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    A ChunkAllocator that backs arena chunks with huge pages. It is kept apart from bfast_arena.h because it needs
+    the OS headers, which programs that only read and write BFAST data should not have to include.
+*/
+#pragma once
+
+#include "bfast_arena.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace bfast
+{
+    // The size of the huge pages used by arenas on Linux and macOS
+    static const size_t huge_page_size = 2 << 20;
+
+    // Gets chunks from MAP_HUGETLB, falling back to transparent huge pages, on Linux and macOS, and from
+    // MEM_LARGE_PAGES on Windows. Large pages on Windows require the SeLockMemoryPrivilege, so there they usually
+    // fail and the arena falls back to the heap.
+    struct HugePageAllocator : ChunkAllocator
+    {
+        uint8_t* allocate(size_t& size) override {
+#ifdef _WIN32
+            auto large = GetLargePageMinimum();
+            if (large == 0) return nullptr;
+            auto n = (size + large - 1) / large * large;
+            auto p = VirtualAlloc(nullptr, n, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (!p) return nullptr;
+            size = n;
+            return (uint8_t*)p;
+#else
+            auto n = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+            void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            p = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+            // Without reserved huge pages, ask for transparent huge pages instead
+            if (p == MAP_FAILED) {
+                p = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+                madvise(p, n, MADV_HUGEPAGE);
+#endif
+            }
+            size = n;
+            return (uint8_t*)p;
+#endif
+        }
+
+        void release(uint8_t* p, size_t size) override {
+#ifdef _WIN32
+            (void)size;
+            VirtualFree(p, 0, MEM_RELEASE);
+#else
+            munmap(p, size);
+#endif
+        }
+    };
+
+    // A huge page allocator that can be shared by any number of arenas
+    inline HugePageAllocator& huge_page_allocator() {
+        static HugePageAllocator r;
+        return r;
+    }
+}
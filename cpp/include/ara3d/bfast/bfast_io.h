@@ -0,0 +1,620 @@
+/*
+    BFAST Platform I/O
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Thin wrappers around the operating system file APIs that the BFAST readers and writers are built on.
+*/
+#pragma once
+
+#include "bfast.h"
+
+#include <string>
+#include <stdexcept>
+#include <new>
+#include <vector>
+#include <atomic>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+namespace bfast
+{
+    // Throws an exception describing the last operating system error
+    static void throw_os_error(const string& what, const string& path) {
+#ifdef _WIN32
+        auto code = (unsigned long)GetLastError();
+        throw runtime_error(what + " failed for '" + path + "' with error code " + to_string(code));
+#else
+        throw runtime_error(what + " failed for '" + path + "': " + strerror(errno));
+#endif
+    }
+
+    // A fixed size block of memory with the start aligned to the given number of bytes (a power of two)
+    struct AlignedBuffer
+    {
+        byte* _begin = nullptr;
+        byte* _end = nullptr;
+
+        AlignedBuffer() { }
+        AlignedBuffer(size_t size, size_t align = alignment) { allocate(size, align); }
+        AlignedBuffer(const AlignedBuffer&) = delete;
+        AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+        AlignedBuffer(AlignedBuffer&& other) { swap(other); }
+        AlignedBuffer& operator=(AlignedBuffer&& other) { release(); swap(other); return *this; }
+        ~AlignedBuffer() { release(); }
+
+        byte* begin() const { return _begin; }
+        byte* end() const { return _end; }
+        byte* data() const { return _begin; }
+        size_t size() const { return end() - begin(); }
+        ByteRange range() const { return { begin(), end() }; }
+
+        void swap(AlignedBuffer& other) {
+            std::swap(_begin, other._begin);
+            std::swap(_end, other._end);
+        }
+
+        void allocate(size_t size, size_t align = alignment) {
+            release();
+            if (size == 0) return;
+#ifdef _WIN32
+            _begin = (byte*)_aligned_malloc(size, align);
+#else
+            void* p = nullptr;
+            if (posix_memalign(&p, max(align, sizeof(void*)), size) == 0)
+                _begin = (byte*)p;
+#endif
+            if (!_begin) throw bad_alloc();
+            _end = _begin + size;
+        }
+
+        void release() {
+            if (!_begin) return;
+#ifdef _WIN32
+            _aligned_free(_begin);
+#else
+            free(_begin);
+#endif
+            _begin = _end = nullptr;
+        }
+    };
+
+    // How a file is opened 
+    enum FileMode
+    {
+        file_read,      // Existing file, read only
+        file_write,     // New or truncated file, read and write
+        file_update,    // Existing file, read and write
+        file_write_direct, // New or truncated file, written without going through the OS cache where possible
+    };
+
+    // The alignment of the memory, file offsets, and sizes of writes to a file opened with file_write_direct.
+    // 4 KB covers the sector size of current disks.
+    static const size_t direct_io_alignment = 4096;
+
+    // Counts the system calls and bytes of the reads and writes made through the files it is attached to with 
+    // File::count_io. One set of counters can be shared by several files and threads.
+    struct IoCounters
+    {
+        atomic<ulong> reads;
+        atomic<ulong> writes;
+        atomic<ulong> bytes_read;
+        atomic<ulong> bytes_written;
+
+        IoCounters() : reads(0), writes(0), bytes_read(0), bytes_written(0) { }
+    };
+
+    // Tells files apart across a process: the volume and file number, which stay the same whatever path the file is
+    // opened through, and the size and last write time, which change when the file is rewritten
+    struct FileIdentity
+    {
+        ulong device = 0;
+        ulong inode = 0;
+        ulong size = 0;
+        ulong mtime = 0;
+
+        bool operator==(const FileIdentity& other) const {
+            return device == other.device && inode == other.inode && size == other.size && mtime == other.mtime;
+        }
+        bool operator!=(const FileIdentity& other) const { return !(*this == other); }
+    };
+
+    // An open operating system file handle. Reads and writes go straight to the OS without any intermediate buffering. 
+    struct File
+    {
+#ifdef _WIN32
+        HANDLE _handle = INVALID_HANDLE_VALUE;
+#else
+        int _fd = -1;
+#endif
+        string _path;
+
+        // True if the file was opened with file_write_direct and the OS cache is being bypassed
+        bool _direct = false;
+
+        // Where reads and writes are counted, if anywhere
+        IoCounters* _counters = nullptr;
+
+        File() { }
+        File(const string& path, FileMode mode) { open(path, mode); }
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+        File(File&& other) { swap(other); }
+        File& operator=(File&& other) { close(); swap(other); return *this; }
+        ~File() { close(); }
+
+        const string& path() const { return _path; }
+
+        void swap(File& other) {
+#ifdef _WIN32
+            std::swap(_handle, other._handle);
+#else
+            std::swap(_fd, other._fd);
+#endif
+            std::swap(_path, other._path);
+            std::swap(_direct, other._direct);
+            std::swap(_counters, other._counters);
+        }
+
+        bool is_open() const {
+#ifdef _WIN32
+            return _handle != INVALID_HANDLE_VALUE;
+#else
+            return _fd >= 0;
+#endif
+        }
+
+        void open(const string& path, FileMode mode) {
+            close();
+            _path = path;
+#ifdef _WIN32
+            DWORD access = mode == file_read ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+            DWORD disposition = mode == file_write || mode == file_write_direct ? CREATE_ALWAYS : OPEN_EXISTING;
+            DWORD attributes = FILE_ATTRIBUTE_NORMAL;
+            if (mode == file_write_direct)
+                attributes |= FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
+            _handle = CreateFileA(path.c_str(), access, FILE_SHARE_READ, nullptr, disposition, attributes, nullptr);
+            _direct = mode == file_write_direct && is_open();
+#else
+            int flags = mode == file_read ? O_RDONLY : mode == file_update ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+            if (mode == file_write_direct) {
+                _fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+                _direct = _fd >= 0;
+            }
+            // Some file systems, such as tmpfs, do not support direct I/O, so fall back to a regular file
+            if (_fd < 0)
+#endif
+            _fd = ::open(path.c_str(), flags, 0644);
+#ifdef F_NOCACHE
+            if (_fd >= 0 && mode == file_write_direct)
+                _direct = fcntl(_fd, F_NOCACHE, 1) == 0;
+#endif
+#endif
+            if (!is_open()) throw_os_error("Opening file", path);
+        }
+
+        void close() {
+#ifdef _WIN32
+            if (_handle != INVALID_HANDLE_VALUE) CloseHandle(_handle);
+            _handle = INVALID_HANDLE_VALUE;
+#else
+            if (_fd >= 0) ::close(_fd);
+            _fd = -1;
+#endif
+            _direct = false;
+        }
+
+        ulong size() const {
+#ifdef _WIN32
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(_handle, &size)) throw_os_error("Getting file size", _path);
+            return size.QuadPart;
+#else
+            struct stat st;
+            if (fstat(_fd, &st) != 0) throw_os_error("Getting file size", _path);
+            return st.st_size;
+#endif
+        }
+
+        FileIdentity identity() const {
+            FileIdentity r;
+#ifdef _WIN32
+            BY_HANDLE_FILE_INFORMATION info;
+            if (!GetFileInformationByHandle(_handle, &info)) throw_os_error("Getting file information", _path);
+            r.device = info.dwVolumeSerialNumber;
+            r.inode = ((ulong)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+            r.size = ((ulong)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+            r.mtime = ((ulong)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+            struct stat st;
+            if (fstat(_fd, &st) != 0) throw_os_error("Getting file information", _path);
+            r.device = (ulong)st.st_dev;
+            r.inode = (ulong)st.st_ino;
+            r.size = (ulong)st.st_size;
+#if defined(__APPLE__)
+            r.mtime = (ulong)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+            r.mtime = (ulong)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+            return r;
+        }
+
+        // Sets the size of the file. When growing, the new bytes read as zero and typically take no disk space until written.
+        void resize(ulong size) {
+#ifdef _WIN32
+            LARGE_INTEGER pos;
+            pos.QuadPart = size;
+            if (!SetFilePointerEx(_handle, pos, nullptr, FILE_BEGIN) || !SetEndOfFile(_handle)) throw_os_error("Resizing file", _path);
+#else
+            if (ftruncate(_fd, size) != 0) throw_os_error("Resizing file", _path);
+#endif
+        }
+
+        // Waits until everything written to the file has reached the storage device 
+        void sync() {
+#ifdef _WIN32
+            if (!FlushFileBuffers(_handle)) throw_os_error("Flushing file", _path);
+#else
+            if (fsync(_fd) != 0) throw_os_error("Flushing file", _path);
+#endif
+        }
+
+        // Hints to the OS that a region of the file will be read soon, so it can start reading it into the page cache.
+        // Does nothing where the OS has no such hint.
+        void read_ahead(ulong offset, ulong n) const {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+            if (n > 0) posix_fadvise(_fd, (off_t)offset, (off_t)n, POSIX_FADV_WILLNEED);
+#else
+            (void)offset; (void)n;
+#endif
+        }
+
+        // Counts the reads and writes made from now on in the given counters, or stops counting if null
+        void count_io(IoCounters* counters) { _counters = counters; }
+
+        void count_read(size_t n) const {
+            if (!_counters) return;
+            _counters->reads++;
+            _counters->bytes_read += n;
+        }
+
+        void count_write(size_t n) const {
+            if (!_counters) return;
+            _counters->writes++;
+            _counters->bytes_written += n;
+        }
+
+        // Reads bytes from the given position in the file, without moving the file position. Throws if the file ends first.
+        // Safe to call concurrently from multiple threads. 
+        void read_at(void* data, size_t n, ulong offset) const {
+            auto p = (byte*)data;
+            while (n > 0) {
+#ifdef _WIN32
+                OVERLAPPED ov = {};
+                ov.Offset = (DWORD)offset;
+                ov.OffsetHigh = (DWORD)(offset >> 32);
+                DWORD read = 0;
+                auto chunk = (DWORD)std::min<size_t>(n, 1 << 30);
+                if (!ReadFile(_handle, p, chunk, &read, &ov) && GetLastError() != ERROR_HANDLE_EOF) throw_os_error("Reading file", _path);
+#else
+                auto read = ::pread(_fd, p, n, offset);
+                if (read < 0) {
+                    if (errno == EINTR) continue;
+                    throw_os_error("Reading file", _path);
+                }
+#endif
+                count_read(read);
+                if (read == 0) throw runtime_error("Unexpected end of file '" + _path + "'");
+                p += read;
+                n -= read;
+                offset += read;
+            }
+        }
+
+        // Writes the bytes at the given position in the file, without moving the file position. 
+        // Safe to call concurrently from multiple threads as long as the written regions do not overlap. 
+        void write_at(const void* data, size_t n, ulong offset) {
+            auto p = (const byte*)data;
+            while (n > 0) {
+#ifdef _WIN32
+                OVERLAPPED ov = {};
+                ov.Offset = (DWORD)offset;
+                ov.OffsetHigh = (DWORD)(offset >> 32);
+                DWORD written = 0;
+                auto chunk = (DWORD)std::min<size_t>(n, 1 << 30);
+                if (!WriteFile(_handle, p, chunk, &written, &ov)) throw_os_error("Writing file", _path);
+#else
+                auto written = ::pwrite(_fd, p, n, offset);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    throw_os_error("Writing file", _path);
+                }
+#endif
+                count_write(written);
+                p += written;
+                n -= written;
+                offset += written;
+            }
+        }
+
+        // Writes the bytes at the current file position, retrying until all of them are written
+        void write(const void* data, size_t n) {
+            ByteRange range = { (const byte*)data, (const byte*)data + n };
+            write_gather(&range, 1);
+        }
+
+        // Writes a sequence of byte ranges at the current file position, in as few system calls as possible. 
+        // The data is written directly from where the ranges point, without being copied into a buffer first.
+        void write_gather(const ByteRange* segments, size_t count) {
+#ifdef _WIN32
+            // WriteFileGather requires page aligned and page sized buffers, so each segment is written with its own call 
+            for (size_t i = 0; i < count; ++i) {
+                auto p = segments[i].begin();
+                auto n = segments[i].size();
+                while (n > 0) {
+                    DWORD written = 0;
+                    auto chunk = (DWORD)std::min<size_t>(n, 1 << 30);
+                    if (!WriteFile(_handle, p, chunk, &written, nullptr)) throw_os_error("Writing file", _path);
+                    count_write(written);
+                    p += written;
+                    n -= written;
+                }
+            }
+#else
+            // The number of segments is limited to IOV_MAX per call (1024 on Linux and macOS)
+            const size_t max_segments = 1024;
+            vector<iovec> iov;
+            for (size_t i = 0; i < count; i += iov.size()) {
+                iov.clear();
+                for (auto j = i; j < count && iov.size() < max_segments; ++j)
+                    iov.push_back({ (void*)segments[j].begin(), segments[j].size() });
+
+                // A single call can write fewer bytes than requested, so skip past what was written and try again 
+                size_t k = 0;
+                while (k < iov.size()) {
+                    auto written = ::writev(_fd, &iov[k], (int)(iov.size() - k));
+                    if (written < 0) {
+                        if (errno == EINTR) continue;
+                        throw_os_error("Writing file", _path);
+                    }
+                    count_write(written);
+                    while (k < iov.size() && (size_t)written >= iov[k].iov_len)
+                        written -= iov[k++].iov_len;
+                    if (k < iov.size()) {
+                        iov[k].iov_base = (byte*)iov[k].iov_base + written;
+                        iov[k].iov_len -= written;
+                    }
+                }
+            }
+#endif
+        }
+    };
+
+    // Counts how the bytes copied by copy_file_data were moved
+    struct CopyStats
+    {
+        // Bytes copied inside the kernel, without passing through user space 
+        ulong kernel_bytes = 0;
+
+        // Bytes read into a user space buffer and written back out
+        ulong buffered_bytes = 0;
+
+        // The number of system calls used to copy
+        size_t calls = 0;
+    };
+
+    // Copies bytes from one file to another at the given positions. On Linux the copy is done inside the kernel with
+    // copy_file_range, which can share blocks on file systems that support it, or with sendfile. When neither is 
+    // possible, such as on Windows or across file systems on older kernels, the bytes are copied through a large buffer. 
+    inline void copy_file_data(const File& src, ulong src_offset, File& dst, ulong dst_offset, ulong n, CopyStats& stats) {
+#ifdef __linux__
+#ifdef __NR_copy_file_range
+        while (n > 0) {
+            loff_t in = src_offset, out = dst_offset;
+            auto copied = syscall(__NR_copy_file_range, src._fd, &in, dst._fd, &out, (size_t)min<ulong>(n, 1 << 30), 0);
+            if (copied < 0 && errno == EINTR) continue;
+            if (copied <= 0) break;
+            stats.calls++;
+            stats.kernel_bytes += copied;
+            src_offset += copied;
+            dst_offset += copied;
+            n -= copied;
+        }
+#endif
+        if (n > 0 && lseek(dst._fd, dst_offset, SEEK_SET) == (off_t)dst_offset) {
+            while (n > 0) {
+                off_t in = src_offset;
+                auto copied = ::sendfile(dst._fd, src._fd, &in, (size_t)min<ulong>(n, 1 << 30));
+                if (copied < 0 && errno == EINTR) continue;
+                if (copied <= 0) break;
+                stats.calls++;
+                stats.kernel_bytes += copied;
+                src_offset += copied;
+                dst_offset += copied;
+                n -= copied;
+            }
+        }
+#endif
+        if (n == 0) return;
+        vector<byte> buffer((size_t)min<ulong>(n, 8 << 20));
+        while (n > 0) {
+            auto chunk = (size_t)min<ulong>(n, buffer.size());
+            src.read_at(buffer.data(), chunk, src_offset);
+            dst.write_at(buffer.data(), chunk, dst_offset);
+            stats.calls += 2;
+            stats.buffered_bytes += chunk;
+            src_offset += chunk;
+            dst_offset += chunk;
+            n -= chunk;
+        }
+    }
+
+    // Renames a file, replacing the target if it exists. On the same volume this happens atomically, so readers see
+    // either the old or the new file, never a partially written one.
+    inline void replace_file(const string& from, const string& to) {
+#ifdef _WIN32
+        if (!MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING)) throw_os_error("Renaming file", from);
+#else
+        if (::rename(from.c_str(), to.c_str()) != 0) throw_os_error("Renaming file", from);
+#endif
+    }
+
+    // A memory mapping of an entire file. Pages are read from disk by the OS the first time they are touched.
+    // Mappings opened for update are shared with the file, so writes to the memory end up in the file.
+    struct MappedFile
+    {
+        byte* _begin = nullptr;
+        byte* _end = nullptr;
+        string _path;
+
+        MappedFile() { }
+        explicit MappedFile(const string& path, FileMode mode = file_read) { open(path, mode); }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        MappedFile(MappedFile&& other) { swap(other); }
+        MappedFile& operator=(MappedFile&& other) { close(); swap(other); return *this; }
+        ~MappedFile() { close(); }
+
+        const byte* begin() const { return _begin; }
+        const byte* end() const { return _end; }
+        size_t size() const { return end() - begin(); }
+        ByteRange range() const { return { begin(), end() }; }
+
+        // Writable access to the mapped memory, only valid if the file was opened for update 
+        byte* data() { return _begin; }
+
+        void swap(MappedFile& other) {
+            std::swap(_begin, other._begin);
+            std::swap(_end, other._end);
+            std::swap(_path, other._path);
+        }
+
+        // Maps the whole file into memory. The file handle is not kept open, the mapping keeps the file alive.
+        void open(const string& path, FileMode mode = file_read) {
+            close();
+            if (mode == file_write || mode == file_write_direct) throw runtime_error("Mapped files must already exist");
+            auto writable = mode == file_update;
+            _path = path;
+#ifdef _WIN32
+            auto file = CreateFileA(path.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | (writable ? FILE_SHARE_WRITE : 0), 
+                nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE) throw_os_error("Opening file", path);
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file, &size)) { CloseHandle(file); throw_os_error("Getting file size", path); }
+            if (size.QuadPart == 0) { CloseHandle(file); return; }
+            auto mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (!mapping) throw_os_error("Creating file mapping", path);
+            auto data = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (!data) throw_os_error("Mapping file", path);
+            _begin = (byte*)data;
+            _end = _begin + size.QuadPart;
+#else
+            auto fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+            if (fd < 0) throw_os_error("Opening file", path);
+            struct stat st;
+            if (fstat(fd, &st) != 0) { ::close(fd); throw_os_error("Getting file size", path); }
+            if (st.st_size == 0) { ::close(fd); return; }
+            auto data = mmap(nullptr, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (data == MAP_FAILED) throw_os_error("Mapping file", path);
+            _begin = (byte*)data;
+            _end = _begin + st.st_size;
+#endif
+        }
+
+        // Writes modified pages back to the file and waits for it to complete 
+        void flush() {
+            if (!_begin) return;
+#ifdef _WIN32
+            if (!FlushViewOfFile(_begin, 0)) throw_os_error("Flushing mapped file", _path);
+#else
+            if (msync(_begin, size(), MS_SYNC) != 0) throw_os_error("Flushing mapped file", _path);
+#endif
+        }
+
+        // Unmaps the file. Any byte ranges pointing into the mapping become invalid.
+        void close() {
+            if (!_begin) return;
+#ifdef _WIN32
+            UnmapViewOfFile(_begin);
+#else
+            munmap(_begin, size());
+#endif
+            _begin = _end = nullptr;
+        }
+
+        // Hints to the OS that a range of the mapping will be accessed soon, so it can start reading it in the background.
+        void prefetch(ByteRange range) const {
+            if (range.size() == 0) return;
+#ifdef _WIN32
+#if _WIN32_WINNT >= 0x0602
+            WIN32_MEMORY_RANGE_ENTRY entry = { (void*)range.begin(), range.size() };
+            PrefetchVirtualMemory(GetCurrentProcess(), 1, &entry, 0);
+#endif
+#else
+            // madvise requires a page aligned address
+            auto page = (size_t)sysconf(_SC_PAGESIZE);
+            auto begin = (size_t)range.begin() / page * page;
+            madvise((void*)begin, (size_t)range.end() - begin, MADV_WILLNEED);
+#endif
+        }
+    };
+
+    // Counts how many bytes of a file are currently held in the OS page cache, which shows how much of the cache a
+    // read or write has taken. Returns false where this cannot be measured, which is on Windows.
+    inline bool page_cache_bytes(const string& path, ulong& resident) {
+        resident = 0;
+#ifdef _WIN32
+        (void)path;
+        return false;
+#else
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw_os_error("Opening file", path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) { ::close(fd); throw_os_error("Getting file size", path); }
+        if (st.st_size == 0) { ::close(fd); return true; }
+        auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) throw_os_error("Mapping file", path);
+        auto page = (size_t)sysconf(_SC_PAGESIZE);
+        auto num_pages = ((size_t)st.st_size + page - 1) / page;
+        vector<unsigned char> pages(num_pages);
+#ifdef __APPLE__
+        auto result = mincore(data, st.st_size, (char*)pages.data());
+#else
+        auto result = mincore(data, st.st_size, pages.data());
+#endif
+        munmap(data, st.st_size);
+        if (result != 0) throw_os_error("Querying page cache", path);
+        for (size_t i = 0; i < num_pages; ++i)
+            if (pages[i] & 1)
+                resident += min<ulong>(page, st.st_size - i * page);
+        return true;
+#endif
+    }
+}
@@ -0,0 +1,161 @@
+/*
+    BFAST Incremental Updates
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    A BFAST file can be updated in place without rewriting it. Replacement arrays are appended to the end of the file,
+    followed by a new generation of the array offsets table (see JournalHeader). Finally the journal pointer in the
+    header extension is switched to the new table with a single small write. Until that write happens readers see the
+    previous generation, so an interrupted update leaves the file as it was, apart from some unused bytes at the end.
+    Readers that do not know about the journal see the original arrays.
+
+    The bytes of replaced arrays and of old tables are dead space. Compacting the file rewrites it without them.
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_reader.h"
+#include "bfast_writer.h"
+#include "bfast_checksum.h"
+
+namespace bfast
+{
+    // Opens an existing BFAST file for incremental updates. Changes are written to the file as they are made, but only
+    // become visible to readers when they are committed. The arrays written by an update take about as many bytes as
+    // the arrays that changed, plus one offsets table.
+    struct BfastUpdater
+    {
+        File file;
+        Header header;
+        HeaderExtension ext = {};
+        ulong generation = 0;
+
+        // The offsets of the arrays, including changes that have not been committed yet
+        vector<ArrayOffset> offsets;
+
+        // The checksums of the arrays, if the file has a checksum table
+        vector<ulong> checksums;
+
+        // Where the next appended bytes go
+        ulong current = 0;
+        bool modified = false;
+
+        BfastUpdater() { }
+        explicit BfastUpdater(const string& path, FileMode mode = file_update) { open(path, mode); }
+
+        // Opens the file. It can be opened with file_read to inspect it without making changes. 
+        void open(const string& path, FileMode mode = file_update) {
+            if (mode == file_write) throw runtime_error("Updates require an existing file");
+            file.open(path, mode);
+            modified = false;
+            offsets = read_offsets(file, &header);
+            checksums = read_checksums(file, offsets.size());
+            file.read_at(&ext, sizeof(ext), header_extension_offset);
+            generation = 0;
+            if (ext.journal != 0) {
+                JournalHeader j;
+                file.read_at(&j, sizeof(j), ext.journal);
+                generation = j.generation;
+            }
+            current = aligned_value(max<ulong>(file.size(), compute_data_start(header.num_arrays)));
+        }
+
+        size_t num_arrays() const { return offsets.size(); }
+
+        // Appends bytes to the end of the file, returning where they were written
+        ulong append(const void* data, size_t n) {
+            auto r = current;
+            file.write_at(data, n, r);
+            current = aligned_value(r + n);
+            return r;
+        }
+
+        // Replaces the contents of an array
+        void replace(size_t i, const void* data, size_t n) {
+            if (i >= offsets.size()) throw runtime_error("Array index is out of range");
+            auto begin = append(data, n);
+            offsets[i] = { begin, begin + n };
+            if (!checksums.empty())
+                checksums[i] = compute_checksum(data, n);
+            modified = true;
+        }
+
+        // Adds a new array after the existing ones
+        void add(const void* data, size_t n) {
+            auto begin = append(data, n);
+            offsets.push_back({ begin, begin + n });
+            if (!checksums.empty())
+                checksums.push_back(compute_checksum(data, n));
+            modified = true;
+        }
+
+        // Makes the changes visible to readers. The new offsets table, and the checksum table if there is one, are
+        // written and flushed to disk before the header extension is switched to point at them, and the header
+        // extension is flushed before returning.
+        void commit() {
+            if (!modified) return;
+            ulong data_end = 0;
+            for (auto& offset : offsets)
+                data_end = max(data_end, offset._end);
+            JournalHeader j = { JOURNAL_MAGIC, generation + 1, offsets.size(), data_end };
+            vector<byte> table(sizeof(j) + offsets.size() * sizeof(ArrayOffset));
+            memcpy(table.data(), &j, sizeof(j));
+            if (!offsets.empty())
+                memcpy(table.data() + sizeof(j), offsets.data(), offsets.size() * sizeof(ArrayOffset));
+
+            auto next = ext;
+            next.journal = append(table.data(), table.size());
+            if (!checksums.empty()) {
+                auto checksum_table = make_checksum_table(checksums);
+                next.checksums = append(checksum_table.data(), checksum_table.size());
+            }
+            file.sync();
+
+            // The header extension fits in a single disk sector, so it is either updated completely or not at all
+            file.write_at(&next, sizeof(next), header_extension_offset);
+            file.sync();
+            ext = next;
+            generation = j.generation;
+            modified = false;
+        }
+
+        // Returns the number of bytes used by the arrays of the current generation. Arrays that share bytes are only counted once.
+        ulong live_bytes() const {
+            auto sorted = offsets;
+            sort(sorted.begin(), sorted.end(), [](const ArrayOffset& a, const ArrayOffset& b) { return a._begin < b._begin; });
+            ulong r = 0, end = 0;
+            for (auto& offset : sorted) {
+                auto begin = max(offset._begin, end);
+                if (offset._end > begin) r += offset._end - begin;
+                end = max(end, offset._end);
+            }
+            return r;
+        }
+
+        // Returns the number of bytes that are not used by the arrays, offsets, or checksums of the current generation,
+        // and that compacting would free. This includes alignment padding.
+        ulong dead_bytes() const {
+            auto needed = compute_data_start(offsets.size()) + live_bytes();
+            if (!checksums.empty())
+                needed += sizeof(ChecksumTableHeader) + checksums.size() * sizeof(ulong);
+            auto size = file.size();
+            return size > needed ? size - needed : 0;
+        }
+    };
+
+    // Rewrites a BFAST file with just the arrays of its latest generation, removing the dead space left by updates.
+    // The file is written next to the original and then renamed over it, so readers never see a partial file.
+    // If the file has checksums the compacted file has them too.
+    static void compact_file(const string& path, WriteOptions options = WriteOptions()) {
+        auto temp = path + ".compact";
+        {
+            MappedBfast m(path);
+            Bfast b;
+            b.ranges = m.ranges;
+            options.checksums = options.checksums || m.checksums.enabled();
+            write_file(b, temp, options);
+        }
+        replace_file(temp, path);
+    }
+}
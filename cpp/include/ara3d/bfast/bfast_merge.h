@@ -0,0 +1,181 @@
+/*
+    BFAST Merging and Repacking
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Builds new BFAST files out of parts of existing files without reading the array data into user space.
+    The layout of the new file is computed from the sizes of the parts, the header and array offsets are written,
+    and then each part is copied from file to file with copy_file_data.
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_reader.h"
+#include "bfast_checksum.h"
+#include "bfast_names.h"
+
+#include <map>
+#include <tuple>
+#include <cstdio>
+
+namespace bfast
+{
+    // Where the bytes of an array of a new file come from: a range of one of the source files, or memory
+    struct ArraySource
+    {
+        static const size_t memory = (size_t)-1;
+
+        // The index of the source file, or memory if the bytes come from data
+        size_t file;
+        ulong offset;
+        ulong size;
+        const byte* data;
+
+        // A checksum of the bytes, if known
+        bool has_checksum;
+        ulong checksum;
+    };
+
+    static ArraySource file_source(size_t file, ulong offset, ulong size) {
+        return { file, offset, size, nullptr, false, 0 };
+    }
+
+    static ArraySource memory_source(const byte* data, size_t size) {
+        return { ArraySource::memory, 0, size, data, false, 0 };
+    }
+
+    // Writes a BFAST whose arrays are copied from the given sources. Only the header, the array offsets, and arrays
+    // that come from memory are written from user space: everything else is copied from file to file.
+    // Parts of the same file that are listed more than once are only stored once. If the checksum of every array
+    // is known a checksum table is added, so existing checksums carry over without reading the data.
+    // The output is truncated before anything is copied, so it must not be one of the files. Use write_replacing to 
+    // write over one of them.
+    static CopyStats write_from_sources(const vector<File>& files, const vector<ArraySource>& arrays, const string& output) {
+        // Store each distinct part once
+        vector<size_t> sizes;
+        vector<size_t> aliases;
+        map<tuple<size_t, ulong, ulong, const byte*>, size_t> first;
+        for (size_t i = 0; i < arrays.size(); ++i) {
+            auto& a = arrays[i];
+            sizes.push_back(a.size);
+            auto key = make_tuple(a.file, a.offset, a.size, a.data);
+            auto found = first.find(key);
+            aliases.push_back(a.size > 0 && found != first.end() ? found->second : i);
+            if (found == first.end()) first[key] = i;
+        }
+        auto offsets = compute_offsets(sizes, aliases);
+        auto preamble = Bfast::compute_preamble(offsets);
+        auto end = compute_needed_size(offsets);
+
+        bool checksums = !arrays.empty();
+        vector<ulong> values;
+        for (auto& a : arrays) {
+            checksums = checksums && a.has_checksum;
+            values.push_back(a.checksum);
+        }
+        HeaderExtension ext = {};
+        if (checksums)
+            ext.checksums = aligned_value(end);
+        set_header_extension(preamble, ext);
+
+        CopyStats stats;
+        File out(output, file_write);
+        out.write_at(preamble.data(), preamble.size(), 0);
+        stats.calls++;
+        for (size_t i = 0; i < arrays.size(); ++i) {
+            auto& a = arrays[i];
+            if (aliases[i] != i || a.size == 0) continue;
+            if (a.file == ArraySource::memory) {
+                out.write_at(a.data, a.size, offsets[i]._begin);
+                stats.calls++;
+            }
+            else {
+                copy_file_data(files.at(a.file), a.offset, out, offsets[i]._begin, a.size, stats);
+            }
+        }
+        if (checksums) {
+            auto table = make_checksum_table(values);
+            out.write_at(table.data(), table.size(), ext.checksums);
+            stats.calls++;
+        }
+        // Make sure the file extends to data end even if the last arrays are empty
+        if (out.size() < end)
+            out.resize(end);
+        return stats;
+    }
+
+    // Calls write with the path of a temporary file next to the output, then moves the temporary file over the output.
+    // The output can be one of the inputs, as long as write closes the inputs before it returns. The temporary file is
+    // removed if write fails.
+    template<typename F>
+    CopyStats write_replacing(const string& output, F write) {
+        auto temp = output + ".tmp";
+        CopyStats r;
+        try {
+            r = write(temp);
+        }
+        catch (...) {
+            std::remove(temp.c_str());
+            throw;
+        }
+        replace_file(temp, output);
+        return r;
+    }
+
+    // Returns the sources for all of the arrays of a BFAST file, carrying over its checksums if it has them
+    static vector<ArraySource> get_array_sources(const File& file, size_t index) {
+        auto offsets = read_offsets(file);
+        auto checksums = read_checksums(file, offsets.size());
+        vector<ArraySource> r;
+        for (size_t i = 0; i < offsets.size(); ++i) {
+            auto source = file_source(index, offsets[i]._begin, offsets[i]._end - offsets[i]._begin);
+            if (!checksums.empty()) {
+                source.has_checksum = true;
+                source.checksum = checksums[i];
+            }
+            r.push_back(source);
+        }
+        return r;
+    }
+
+    // Rewrites a BFAST file with a fresh layout, holding just the arrays of its latest generation, without copying
+    // the data through user space
+    static CopyStats repack_file(const string& input, const string& output) {
+        return write_replacing(output, [&](const string& temp) {
+            vector<File> files;
+            files.emplace_back(input, file_read);
+            return write_from_sources(files, get_array_sources(files[0], 0), temp);
+        });
+    }
+
+    // Writes a BFAST with all of the arrays of the input files, one file after the other
+    static CopyStats concat_files(const vector<string>& inputs, const string& output) {
+        return write_replacing(output, [&](const string& temp) {
+            vector<File> files;
+            vector<ArraySource> arrays;
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                files.emplace_back(inputs[i], file_read);
+                auto sources = get_array_sources(files.back(), i);
+                arrays.insert(arrays.end(), sources.begin(), sources.end());
+            }
+            return write_from_sources(files, arrays, temp);
+        });
+    }
+
+    // Writes a container BFAST with each of the input files, such as G3D files, stored whole as one of its arrays.
+    // The first array holds the given names, one for each file, so the files can be found with NameIndex or BfastView.
+    static CopyStats merge_files(const vector<string>& inputs, const string& output, const vector<string>& names) {
+        if (names.size() != inputs.size()) throw runtime_error("Expected one name per input file");
+        auto names_array = make_names_array(names);
+        return write_replacing(output, [&](const string& temp) {
+            vector<File> files;
+            vector<ArraySource> arrays = { memory_source(names_array.data(), names_array.size()) };
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                files.emplace_back(inputs[i], file_read);
+                arrays.push_back(file_source(i, 0, files.back().size()));
+            }
+            return write_from_sources(files, arrays, temp);
+        });
+    }
+}
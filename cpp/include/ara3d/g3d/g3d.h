@@ -9,7 +9,7 @@
 #include <sstream>
 #include <map>
 
-#include <ara3d\bfast\bfast.h>
+#include "../bfast/bfast.h"
 
 #define G3D_VERSION { 0, 9, 0, "2018.12.24" }
 
@@ -89,6 +89,28 @@ namespace g3d
         int32_t _data_type;              // the type of individual values (e.g. int32, float64)
         int32_t _pad0, _pad1, _pad2;     // ignored, used to bring the alignment up to a power of two.
 
+        // Descriptors are equal when they describe the same attribute, whatever is in the padding 
+        bool operator==(const AttributeDescriptor& other) const {
+            return _association == other._association
+                && _attribute_type == other._attribute_type
+                && _attribute_type_index == other._attribute_type_index
+                && _data_arity == other._data_arity
+                && _data_type == other._data_type;
+        }
+
+        bool operator!=(const AttributeDescriptor& other) const {
+            return !(*this == other);
+        }
+
+        // Combines the same fields that are compared for equality
+        size_t hash() const {
+            uint64_t h = 0;
+            for (auto x : { _association, _attribute_type, _attribute_type_index, _data_arity, _data_type })
+                h = (h ^ (uint32_t)x) * 0x100000001B3ull;
+            h ^= h >> 32;
+            return (size_t)h;
+        }
+
         void validate() const {
             if (_association < 0 || _association >= assoc_invalid) throw runtime_error("association out of range");
             if (_attribute_type < 0 || _attribute_type >= attr_invalid) throw runtime_error("attribute type out of range");
@@ -332,6 +354,17 @@ namespace g3d
         size_t num_elements() const {
             return byte_size() / data_element_size();
         }
+        // The data as an array of T, which must evenly divide the elements (e.g. float or a struct of 3 floats for float32 x 3)
+        template<typename T>
+        T* begin_as() const {
+            if (data_element_size() % sizeof(T) != 0) throw runtime_error("Type does not match the attribute elements");
+            return (T*)_begin;
+        }
+        template<typename T>
+        T* end_as() const {
+            if (data_element_size() % sizeof(T) != 0) throw runtime_error("Type does not match the attribute elements");
+            return (T*)_end;
+        }
         AttributeDescriptor descriptor;
         uint8_t* _begin;
         uint8_t* _end;
@@ -485,4 +518,108 @@ namespace g3d
             add_map_channel_index(id, num_texture_faces * 3, texture_indices);
         }
     };
+
+    // Reads a G3D straight from the bytes of a BFAST, such as a memory-mapped file, without copying any attribute data.
+    // The header and attribute descriptors are validated, and each attribute points into the bytes, so the only memory 
+    // allocated is the attribute table and its index. The view must not outlive the bytes. Arrays are 64-byte aligned 
+    // within a BFAST, so when the bytes are aligned too (as a mapping is) attribute data can be cast to its element type.
+    struct G3dView
+    {
+        static const size_t npos = (size_t)-1;
+
+        // The meta-data of the G3D, as UTF-8 text
+        bfast::ByteRange header = { nullptr, nullptr };
+
+        vector<Attribute> attributes;
+
+        // An open addressing hash table from descriptors to attribute indices, with at least twice as many slots as 
+        // attributes so that a lookup usually probes a single slot. Empty slots hold -1.
+        vector<int32_t> _slots;
+
+        G3dView() { }
+        explicit G3dView(bfast::ByteRange bytes) { open(bytes); }
+
+        // Parses a G3D, throwing an exception if it is not valid. Follows the journal of a BFAST that was updated. 
+        void open(bfast::ByteRange bytes) {
+            header = { nullptr, nullptr };
+            attributes.clear();
+            _slots.clear();
+
+            bfast::Header h;
+            auto position = bfast::get_latest_offsets_position(bytes, h);
+            if (h.num_arrays < 2) throw runtime_error("Expected at least two arrays in a G3D: the header and the attribute descriptors");
+            auto array = [&](size_t i) {
+                bfast::ArrayOffset offset;
+                memcpy(&offset, bytes.begin() + position + i * sizeof(offset), sizeof(offset));
+                bfast::validate_offset(h, offset);
+                return bfast::ByteRange{ bytes.begin() + offset._begin, bytes.begin() + offset._end };
+            };
+
+            header = array(0);
+            auto descriptors = array(1);
+            auto n = (size_t)h.num_arrays - 2;
+            if (descriptors.size() != n * sizeof(AttributeDescriptor)) throw runtime_error("Expected one attribute descriptor for each attribute array");
+            attributes.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                // Copied out, since the bytes might not be aligned for the descriptor fields
+                AttributeDescriptor desc;
+                memcpy(&desc, descriptors.begin() + i * sizeof(desc), sizeof(desc));
+                desc.validate();
+                auto data = array(i + 2);
+                if (data.size() % (desc.data_type_size() * (size_t)desc.data_arity()) != 0)
+                    throw runtime_error("Size of attribute " + std::to_string(i) + " is not a multiple of its element size");
+                // Attributes hold non-const pointers, but nothing is written through them 
+                attributes.emplace_back(desc, (void*)data.begin(), (void*)data.end());
+            }
+            build_index();
+        }
+
+        // Builds the lookup table of the attributes. Called by open, or after filling in the attributes directly.
+        void build_index() {
+            size_t num_slots = 1;
+            while (num_slots < attributes.size() * 2) num_slots *= 2;
+            _slots.assign(num_slots, -1);
+            for (size_t i = 0; i < attributes.size(); ++i) {
+                auto slot = attributes[i].descriptor.hash() & (num_slots - 1);
+                // When two attributes have the same descriptor the first one is found 
+                while (_slots[slot] >= 0 && attributes[_slots[slot]].descriptor != attributes[i].descriptor)
+                    slot = (slot + 1) & (num_slots - 1);
+                if (_slots[slot] < 0) 
+                    _slots[slot] = (int32_t)i;
+            }
+        }
+
+        size_t num_attributes() const { return attributes.size(); }
+
+        string header_string() const { return string((const char*)header.begin(), header.size()); }
+
+        // Returns the index of the attribute with the given descriptor, or npos if there is none
+        size_t find(const AttributeDescriptor& desc) const {
+            if (_slots.empty()) return npos;
+            auto mask = _slots.size() - 1;
+            for (auto slot = desc.hash() & mask; _slots[slot] >= 0; slot = (slot + 1) & mask)
+                if (attributes[_slots[slot]].descriptor == desc)
+                    return (size_t)_slots[slot];
+            return npos;
+        }
+
+        // Returns the attribute with the given descriptor, or null if there is none
+        const Attribute* attribute(const AttributeDescriptor& desc) const {
+            auto i = find(desc);
+            return i == npos ? nullptr : &attributes[i];
+        }
+
+        const Attribute* attribute(const string& desc) const {
+            return attribute(AttributeDescriptor::from_string(desc));
+        }
+
+        // The attributes that G3d::add_vertices and G3d::add_indexes write 
+        const Attribute* vertices() const {
+            return attribute(AttributeDescriptor{ assoc_vertex, attr_coordinate, 0, 3, dt_float32, 0, 0, 0 });
+        }
+
+        const Attribute* indices() const {
+            return attribute(AttributeDescriptor{ assoc_corner, attr_index, 0, 1, dt_int32, 0, 0, 0 });
+        }
+    };
 }
\ No newline at end of file
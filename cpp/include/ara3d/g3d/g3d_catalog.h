@@ -0,0 +1,422 @@
+/*
+    G3D Catalog
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    An index over a directory tree of BFAST and G3D files, recording the header, array offsets, and attribute
+    descriptors of every file, so that inventory queries can be answered without opening any of the files.
+
+    The catalog is itself a BFAST, which is memory mapped when it is opened, with four arrays:
+        0: the paths of the files, separated by null characters, sorted
+        1: a CatalogEntry for each file, in the same order
+        2: the array offsets of all of the files, one after the other
+        3: the attribute descriptors of all of the G3D files, one after the other
+*/
+#pragma once
+
+#include "g3d.h"
+
+#include "../bfast/bfast_reader.h"
+#include "../bfast/bfast_writer.h"
+#include "../bfast/bfast_parallel.h"
+#include "../bfast/bfast_names.h"
+
+#include <cctype>
+#include <condition_variable>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+namespace g3d
+{
+    // Set in CatalogEntry::flags when the file is a valid BFAST
+    static const uint64_t catalog_bfast = 1;
+
+    // Set in CatalogEntry::flags when the file is a valid G3D, with attribute descriptors for all of its attributes
+    static const uint64_t catalog_g3d = 2;
+
+    // What the catalog records about one file
+    struct CatalogEntry
+    {
+        // The size and modification time of the file when it was read, used to detect changes. The time is in
+        // OS specific units and is only compared for equality.
+        uint64_t size;
+        uint64_t mtime;
+
+        // The path of the file, as a range of the paths array
+        uint64_t path_begin;
+        uint64_t path_end;
+
+        // The array offsets of the file, as a range of the offsets array
+        uint64_t first_array;
+        uint64_t num_arrays;
+
+        // The attribute descriptors of the file, as a range of the descriptors array. For a G3D, descriptor i
+        // describes array i + 2.
+        uint64_t first_descriptor;
+        uint64_t num_descriptors;
+
+        // The data end of the BFAST header
+        uint64_t data_end;
+        uint64_t flags;
+    };
+
+    // A file found while scanning a directory tree
+    struct FoundFile
+    {
+        string path;
+        uint64_t size;
+        uint64_t mtime;
+    };
+
+    // Returns true if the path ends with one of the extensions, ignoring case. An empty list matches every file.
+    static bool has_extension(const string& path, const vector<string>& extensions) {
+        if (extensions.empty()) return true;
+        for (auto& ext : extensions) {
+            if (path.size() < ext.size()) continue;
+            bool match = true;
+            for (size_t i = 0; i < ext.size() && match; ++i)
+                match = tolower((unsigned char)path[path.size() - ext.size() + i]) == tolower((unsigned char)ext[i]);
+            if (match) return true;
+        }
+        return false;
+    }
+
+    // Lists the files and subdirectories of one directory
+    static void list_directory(const string& dir, const vector<string>& extensions, vector<string>& subdirs, vector<FoundFile>& files) {
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        auto h = FindFirstFileExA((dir + "\\*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+        if (h == INVALID_HANDLE_VALUE) return;
+        do {
+            string name = data.cFileName;
+            if (name == "." || name == "..") continue;
+            if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+            auto path = dir + "\\" + name;
+            if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                subdirs.push_back(path);
+            else if (has_extension(name, extensions))
+                files.push_back({ path, ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow,
+                    ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime });
+        } while (FindNextFileA(h, &data));
+        FindClose(h);
+#else
+        auto d = opendir(dir.c_str());
+        if (!d) return;
+        while (auto e = readdir(d)) {
+            string name = e->d_name;
+            if (name == "." || name == "..") continue;
+            struct stat st;
+            if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            auto path = dir + "/" + name;
+            if (S_ISDIR(st.st_mode))
+                subdirs.push_back(path);
+            else if (S_ISREG(st.st_mode) && has_extension(name, extensions)) {
+#if defined(__APPLE__)
+                uint64_t mtime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+                uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+                files.push_back({ path, (uint64_t)st.st_size, mtime });
+            }
+        }
+        closedir(d);
+#endif
+    }
+
+    // Finds all of the files with the given extensions in a directory tree, sorted by path. Directories are listed
+    // by several threads at once, which matters on network drives and when the tree holds many thousands of files.
+    // Symbolic links and other reparse points are not followed.
+    static vector<FoundFile> find_files(const string& root, const vector<string>& extensions, size_t num_threads = 0) {
+        if (num_threads == 0) num_threads = bfast::default_num_threads();
+        vector<string> dirs = { root };
+        vector<FoundFile> r;
+        size_t busy = 0;
+        mutex m;
+        condition_variable changed;
+
+        // Each thread takes a directory, lists it, and queues its subdirectories, until there are no directories
+        // left and no thread is listing one
+        auto worker = [&]() {
+            vector<string> subdirs;
+            vector<FoundFile> files;
+            unique_lock<mutex> lock(m);
+            while (true) {
+                changed.wait(lock, [&]() { return !dirs.empty() || busy == 0; });
+                if (dirs.empty()) break;
+                auto dir = move(dirs.back());
+                dirs.pop_back();
+                ++busy;
+                lock.unlock();
+                subdirs.clear();
+                files.clear();
+                list_directory(dir, extensions, subdirs, files);
+                lock.lock();
+                --busy;
+                dirs.insert(dirs.end(), subdirs.begin(), subdirs.end());
+                r.insert(r.end(), files.begin(), files.end());
+                changed.notify_all();
+            }
+        };
+
+        vector<thread> threads;
+        for (size_t i = 1; i < num_threads; ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads)
+            t.join();
+        sort(r.begin(), r.end(), [](const FoundFile& a, const FoundFile& b) { return a.path < b.path; });
+        return r;
+    }
+
+    // Options for building a catalog
+    struct CatalogOptions
+    {
+        // The extensions of the files to include
+        vector<string> extensions = { ".g3d", ".bfast" };
+
+        // The number of threads used to scan directories and read files, or zero to use all cores
+        size_t num_threads = 0;
+    };
+
+    // What happened while building or updating a catalog
+    struct CatalogStats
+    {
+        size_t files = 0;
+
+        // Files whose entries were carried over because their size and modification time had not changed
+        size_t reused = 0;
+
+        // Files that were new or had changed, and were read
+        size_t read = 0;
+
+        // Files in the previous catalog that no longer exist
+        size_t removed = 0;
+
+        // Files in the catalog that could not be read as a BFAST, whether they were read this time or before
+        size_t invalid = 0;
+    };
+
+    // A memory mapped catalog. Opening it only checks that the entries are in range, and all of the queries then read
+    // straight from the mapping, without copying or parsing anything.
+    struct Catalog
+    {
+        bfast::MappedFile file;
+        vector<bfast::ByteRange> arrays;
+        const CatalogEntry* _entries = nullptr;
+        size_t _num_entries = 0;
+
+        Catalog() { }
+        explicit Catalog(const string& path) { open(path); }
+
+        void open(const string& path) {
+            close();
+            file.open(path);
+            arrays = bfast::get_ranges(file.range());
+            if (arrays.size() != 4) throw runtime_error("Not a G3D catalog: " + path);
+            if (arrays[1].size() % sizeof(CatalogEntry) != 0
+                || arrays[2].size() % sizeof(bfast::ArrayOffset) != 0
+                || arrays[3].size() % sizeof(AttributeDescriptor) != 0)
+                throw runtime_error("G3D catalog is corrupted: " + path);
+            _entries = (const CatalogEntry*)arrays[1].begin();
+            _num_entries = arrays[1].size() / sizeof(CatalogEntry);
+            for (size_t i = 0; i < _num_entries; ++i) {
+                auto& e = _entries[i];
+                if (e.path_begin > e.path_end || e.path_end > arrays[0].size()
+                    || e.first_array + e.num_arrays > arrays[2].size() / sizeof(bfast::ArrayOffset)
+                    || e.first_descriptor + e.num_descriptors > arrays[3].size() / sizeof(AttributeDescriptor))
+                    throw runtime_error("G3D catalog is corrupted: " + path);
+            }
+        }
+
+        void close() {
+            file.close();
+            arrays.clear();
+            _entries = nullptr;
+            _num_entries = 0;
+        }
+
+        size_t size() const { return _num_entries; }
+        const CatalogEntry& entry(size_t i) const { return _entries[i]; }
+
+        string path(size_t i) const {
+            auto& e = entry(i);
+            return string((const char*)arrays[0].begin() + e.path_begin, e.path_end - e.path_begin);
+        }
+
+        // The array offsets of a file
+        const bfast::ArrayOffset* offsets(size_t i) const {
+            return (const bfast::ArrayOffset*)arrays[2].begin() + entry(i).first_array;
+        }
+
+        // The attribute descriptors of a G3D file
+        const AttributeDescriptor* descriptors(size_t i) const {
+            return (const AttributeDescriptor*)arrays[3].begin() + entry(i).first_descriptor;
+        }
+
+        // Returns the index of the file with the given path, or npos if there is none. Paths are sorted, so this is
+        // a binary search.
+        size_t find(const string& p) const {
+            size_t lo = 0, hi = size();
+            while (lo < hi) {
+                auto mid = lo + (hi - lo) / 2;
+                auto& e = entry(mid);
+                auto c = p.compare(0, string::npos, (const char*)arrays[0].begin() + e.path_begin, e.path_end - e.path_begin);
+                if (c == 0) return mid;
+                if (c < 0) hi = mid;
+                else lo = mid + 1;
+            }
+            return string::npos;
+        }
+    };
+
+    // Reads the header, array offsets, and attribute descriptors of a file into a catalog entry, appending the
+    // offsets and descriptors to the given vectors. Files that are not a valid BFAST are recorded with no arrays.
+    static void read_catalog_entry(const FoundFile& found, CatalogEntry& e, vector<bfast::ArrayOffset>& offsets, vector<AttributeDescriptor>& descriptors) {
+        e = {};
+        e.size = found.size;
+        e.mtime = found.mtime;
+        try {
+            bfast::File f(found.path, bfast::file_read);
+            bfast::Header h;
+            offsets = bfast::read_offsets(f, &h);
+            e.data_end = h.data_end;
+            e.flags = catalog_bfast;
+            // A G3D has a meta-data string, then one descriptor for each of the attribute arrays that follow
+            if (offsets.size() >= 2) {
+                auto size = offsets[1]._end - offsets[1]._begin;
+                if (size == (offsets.size() - 2) * sizeof(AttributeDescriptor)) {
+                    descriptors.resize(offsets.size() - 2);
+                    if (size > 0)
+                        f.read_at(descriptors.data(), (size_t)size, offsets[1]._begin);
+                    for (auto& d : descriptors)
+                        d.validate();
+                    e.flags |= catalog_g3d;
+                }
+            }
+        }
+        catch (const exception&) {
+            if (!(e.flags & catalog_bfast)) offsets.clear();
+            descriptors.clear();
+        }
+        e.num_arrays = offsets.size();
+        e.num_descriptors = descriptors.size();
+    }
+
+    // Removes the catalog, and the temporary file it is written to, from the files found, for when the catalog is
+    // inside the tree. Files are matched by identity, so it does not matter how their paths are written. Only files
+    // with the same size as the catalog are opened to compare them.
+    static void exclude_catalog(vector<FoundFile>& found, const string& catalog_path) {
+        vector<bfast::FileIdentity> catalog;
+        for (auto& path : { catalog_path, catalog_path + ".tmp" }) {
+            try {
+                catalog.push_back(bfast::File(path, bfast::file_read).identity());
+            }
+            catch (const exception&) {
+                // The file does not exist
+            }
+        }
+        found.erase(remove_if(found.begin(), found.end(), [&](const FoundFile& f) {
+            for (auto& id : catalog) {
+                if (f.size != id.size) continue;
+                try {
+                    if (bfast::File(f.path, bfast::file_read).identity() == id) return true;
+                }
+                catch (const exception&) {
+                    // An unreadable file is not the catalog
+                }
+            }
+            return false;
+        }), found.end());
+    }
+
+    // Builds a catalog of the files in a directory tree. If the catalog already exists it is updated: only the
+    // files that are new, or whose size or modification time have changed, are read. The new catalog is written
+    // next to the old one and renamed over it, so readers never see a partial catalog.
+    static CatalogStats build_catalog(const string& root, const string& catalog_path, const CatalogOptions& options = CatalogOptions()) {
+        CatalogStats stats;
+        auto found = find_files(root, options.extensions, options.num_threads);
+        exclude_catalog(found, catalog_path);
+        stats.files = found.size();
+
+        Catalog old;
+        try {
+            if (bfast::File(catalog_path, bfast::file_read).size() > 0)
+                old.open(catalog_path);
+        }
+        catch (const exception&) {
+            // A missing or unreadable catalog is rebuilt from scratch
+            old.close();
+        }
+
+        // Read the files that have changed in parallel, each into its own vectors
+        vector<size_t> previous(found.size(), string::npos);
+        vector<size_t> changed;
+        size_t still_present = 0;
+        for (size_t i = 0; i < found.size(); ++i) {
+            auto j = old.find(found[i].path);
+            if (j != string::npos) still_present++;
+            if (j != string::npos && old.entry(j).size == found[i].size && old.entry(j).mtime == found[i].mtime)
+                previous[i] = j;
+            else
+                changed.push_back(i);
+        }
+        stats.reused = found.size() - changed.size();
+        stats.read = changed.size();
+        stats.removed = old.size() - still_present;
+
+        vector<CatalogEntry> changed_entries(changed.size());
+        vector<vector<bfast::ArrayOffset>> changed_offsets(changed.size());
+        vector<vector<AttributeDescriptor>> changed_descriptors(changed.size());
+        bfast::parallel_for(changed.size(), [&](size_t i) {
+            read_catalog_entry(found[changed[i]], changed_entries[i], changed_offsets[i], changed_descriptors[i]);
+        }, options.num_threads);
+
+        // Gather the entries in path order
+        vector<string> paths;
+        vector<CatalogEntry> entries;
+        vector<bfast::ArrayOffset> offsets;
+        vector<AttributeDescriptor> descriptors;
+        uint64_t path_size = 0;
+        size_t next_changed = 0;
+        for (size_t i = 0; i < found.size(); ++i) {
+            CatalogEntry e;
+            const bfast::ArrayOffset* file_offsets;
+            const AttributeDescriptor* file_descriptors;
+            if (previous[i] != string::npos) {
+                e = old.entry(previous[i]);
+                file_offsets = old.offsets(previous[i]);
+                file_descriptors = old.descriptors(previous[i]);
+            }
+            else {
+                auto k = next_changed++;
+                e = changed_entries[k];
+                file_offsets = changed_offsets[k].data();
+                file_descriptors = changed_descriptors[k].data();
+            }
+            if (!(e.flags & catalog_bfast)) stats.invalid++;
+            e.path_begin = path_size;
+            e.path_end = path_size + found[i].path.size();
+            path_size = e.path_end + 1;
+            e.first_array = offsets.size();
+            e.first_descriptor = descriptors.size();
+            offsets.insert(offsets.end(), file_offsets, file_offsets + e.num_arrays);
+            descriptors.insert(descriptors.end(), file_descriptors, file_descriptors + e.num_descriptors);
+            entries.push_back(e);
+            paths.push_back(found[i].path);
+        }
+        old.close();
+
+        auto paths_array = bfast::make_names_array(paths);
+        bfast::Bfast b;
+        b.add_array(paths_array.data(), paths_array.data() + paths_array.size());
+        b.add_array(entries.data(), entries.data() + entries.size());
+        b.add_array(offsets.data(), offsets.data() + offsets.size());
+        b.add_array(descriptors.data(), descriptors.data() + descriptors.size());
+        auto temp = catalog_path + ".tmp";
+        bfast::write_file(b, temp);
+        bfast::replace_file(temp, catalog_path);
+        return stats;
+    }
+}
@@ -0,0 +1,231 @@
+/*
+    G3D Attribute Subsets
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Loads only some of the attributes of a G3D file, such as the vertex positions and indices needed for picking or
+    bounding volumes, chosen by a filter on their descriptors. Only the header, the array offsets, the attribute
+    descriptors, and the arrays of the matching attributes are read, and the bytes and time it took are reported.
+*/
+#pragma once
+
+#include "g3d.h"
+
+#include "../bfast/bfast_reader.h"
+
+#include <chrono>
+
+namespace g3d
+{
+    // Matches attribute descriptors against a pattern written like a descriptor string, in which any field can be *
+    // to match every value, and trailing fields can be left out:
+    //     g3d:vertex:coordinate:0:float32:3    exactly the vertex positions
+    //     g3d:*:index                          indices of any kind
+    //     g3d:vertex                           every vertex attribute
+    struct AttributeFilter
+    {
+        // The value of each descriptor field to match, or -1 to match any value
+        int32_t association = -1;
+        int32_t attribute_type = -1;
+        int32_t attribute_type_index = -1;
+        int32_t data_type = -1;
+        int32_t data_arity = -1;
+
+        // Matches exactly the attributes with the given descriptor
+        static AttributeFilter exact(const AttributeDescriptor& desc) {
+            AttributeFilter r;
+            r.association = desc._association;
+            r.attribute_type = desc._attribute_type;
+            r.attribute_type_index = desc._attribute_type_index;
+            r.data_type = desc._data_type;
+            r.data_arity = desc._data_arity;
+            return r;
+        }
+
+        static AttributeFilter parse(const string& pattern) {
+            auto tokens = AttributeDescriptor::split(pattern, ':');
+            if (tokens.empty() || tokens[0] != "g3d") throw runtime_error("Expected g3d at the start of attribute pattern: " + pattern);
+            if (tokens.size() > 6) throw runtime_error("Too many fields in attribute pattern: " + pattern);
+            tokens.resize(6, "*");
+            AttributeFilter r;
+            try {
+                if (tokens[1] != "*") r.association = AttributeDescriptor::association_from_string(tokens[1]);
+                if (tokens[2] != "*") r.attribute_type = AttributeDescriptor::attribute_type_from_string(tokens[2]);
+                if (tokens[3] != "*") r.attribute_type_index = stoi(tokens[3]);
+                if (tokens[4] != "*") r.data_type = AttributeDescriptor::data_type_from_string(tokens[4]);
+                if (tokens[5] != "*") r.data_arity = stoi(tokens[5]);
+            }
+            catch (const logic_error&) {
+                throw runtime_error("Invalid attribute pattern: " + pattern);
+            }
+            return r;
+        }
+
+        bool matches(const AttributeDescriptor& desc) const {
+            return (association < 0 || association == desc._association)
+                && (attribute_type < 0 || attribute_type == desc._attribute_type)
+                && (attribute_type_index < 0 || attribute_type_index == desc._attribute_type_index)
+                && (data_type < 0 || data_type == desc._data_type)
+                && (data_arity < 0 || data_arity == desc._data_arity);
+        }
+    };
+
+    // Returns true if any of the filters matches the descriptor
+    static bool matches_any(const vector<AttributeFilter>& filters, const AttributeDescriptor& desc) {
+        for (auto& f : filters)
+            if (f.matches(desc))
+                return true;
+        return false;
+    }
+
+    struct SubsetOptions
+    {
+        // Selected arrays separated by at most this many bytes are read with one call, which may read some bytes of
+        // the attributes in between
+        size_t gap_threshold = 64 << 10;
+
+        // When true the meta-data array is loaded too, and set as the header of the view
+        bool header = false;
+    };
+
+    // What loading a subset of a G3D cost
+    struct SubsetStats
+    {
+        // The bytes read from the file, including the header, offsets, checksums, and descriptors. For a memory
+        // mapped file, the bytes of the parts of the file that are accessed.
+        ulong bytes_read = 0;
+
+        // The number of read calls made, or zero for a memory mapped file
+        size_t reads = 0;
+
+        size_t attributes_loaded = 0;
+        size_t attributes_skipped = 0;
+
+        // The bytes of the attributes that were not loaded
+        ulong bytes_skipped = 0;
+
+        double seconds = 0;
+    };
+
+    // Some of the attributes of a G3D, and the memory they point into. The attributes can be looked up through the
+    // view, which only holds the attributes that were loaded.
+    struct G3dSubset
+    {
+        G3dView view;
+
+        // The descriptors of all of the attributes in the file, including the ones that were not loaded
+        vector<AttributeDescriptor> descriptors;
+
+        SubsetStats stats;
+
+        // Where the attributes point: the arrays read from the file, or the mapping of the file
+        bfast::LoadedArrays arrays;
+        bfast::MappedFile mapping;
+
+        G3dSubset() { }
+        G3dSubset(G3dSubset&&) = default;
+        G3dSubset& operator=(G3dSubset&&) = default;
+    };
+
+    // Checks the descriptors of a G3D against its array offsets, and fills in the stats for the attributes
+    // that match the filters. Returns the array index of each matching attribute.
+    static vector<size_t> select_attributes(const vector<bfast::ArrayOffset>& offsets, const vector<AttributeDescriptor>& descriptors,
+        const vector<AttributeFilter>& filters, SubsetStats& stats)
+    {
+        if (descriptors.size() + 2 != offsets.size()) throw runtime_error("Expected one attribute descriptor for each attribute array");
+        vector<size_t> r;
+        for (size_t i = 0; i < descriptors.size(); ++i) {
+            auto& desc = descriptors[i];
+            desc.validate();
+            auto size = offsets[i + 2]._end - offsets[i + 2]._begin;
+            if (size % (desc.data_type_size() * (size_t)desc.data_arity()) != 0)
+                throw runtime_error("Size of attribute " + std::to_string(i) + " is not a multiple of its element size");
+            if (matches_any(filters, desc)) {
+                r.push_back(i + 2);
+                stats.attributes_loaded++;
+            }
+            else {
+                stats.attributes_skipped++;
+                stats.bytes_skipped += size;
+            }
+        }
+        return r;
+    }
+
+    // Reads the attributes of a G3D file that match any of the filters, with as few reads as possible. The other
+    // attributes are never read. Arrays are checked against their checksums if the file has them.
+    static G3dSubset load_g3d_subset(const string& path, const vector<AttributeFilter>& filters, const SubsetOptions& options = SubsetOptions()) {
+        auto start = chrono::steady_clock::now();
+        G3dSubset r;
+        bfast::IoCounters counters;
+        bfast::BfastFile f;
+        f.open(path, &counters);
+        if (f.num_arrays() < 2) throw runtime_error("Expected at least two arrays in a G3D: the header and the attribute descriptors");
+
+        auto table = f.read_array(1);
+        r.descriptors.resize(table[0].size() / sizeof(AttributeDescriptor));
+        if (table[0].size() != r.descriptors.size() * sizeof(AttributeDescriptor)) throw runtime_error("Attribute descriptors are truncated");
+        if (!r.descriptors.empty())
+            memcpy(r.descriptors.data(), table[0].begin(), table[0].size());
+        auto selected = select_attributes(f.offsets, r.descriptors, filters, r.stats);
+
+        auto indices = selected;
+        if (options.header) indices.insert(indices.begin(), 0);
+        r.arrays = f.read_arrays(indices, options.gap_threshold);
+        size_t k = 0;
+        if (options.header) r.view.header = r.arrays[k++];
+        r.view.attributes.reserve(selected.size());
+        for (auto i : selected) {
+            auto data = r.arrays[k++];
+            r.view.attributes.emplace_back(r.descriptors[i - 2], (void*)data.begin(), (void*)data.end());
+        }
+        r.view.build_index();
+
+        r.stats.bytes_read = counters.bytes_read;
+        r.stats.reads = (size_t)counters.reads.load();
+        r.stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return r;
+    }
+
+    // Maps a G3D file and selects the attributes that match any of the filters. Nothing is copied, and the OS is
+    // asked to read ahead only the selected attributes, so the pages of the others are not touched.
+    static G3dSubset map_g3d_subset(const string& path, const vector<AttributeFilter>& filters, const SubsetOptions& options = SubsetOptions()) {
+        auto start = chrono::steady_clock::now();
+        G3dSubset r;
+        r.mapping.open(path);
+        auto bytes = r.mapping.range();
+        bfast::Header h;
+        auto position = bfast::get_latest_offsets_position(bytes, h);
+        vector<bfast::ArrayOffset> offsets((size_t)h.num_arrays);
+        if (!offsets.empty())
+            memcpy(offsets.data(), bytes.begin() + position, offsets.size() * sizeof(bfast::ArrayOffset));
+        for (auto& offset : offsets)
+            bfast::validate_offset(h, offset);
+        if (offsets.size() < 2) throw runtime_error("Expected at least two arrays in a G3D: the header and the attribute descriptors");
+        r.stats.bytes_read = position + offsets.size() * sizeof(bfast::ArrayOffset);
+
+        auto table = bfast::ByteRange{ bytes.begin() + offsets[1]._begin, bytes.begin() + offsets[1]._end };
+        r.descriptors.resize(table.size() / sizeof(AttributeDescriptor));
+        if (table.size() != r.descriptors.size() * sizeof(AttributeDescriptor)) throw runtime_error("Attribute descriptors are truncated");
+        if (!r.descriptors.empty())
+            memcpy(r.descriptors.data(), table.begin(), table.size());
+        r.stats.bytes_read += table.size();
+        auto selected = select_attributes(offsets, r.descriptors, filters, r.stats);
+
+        auto range = [&](size_t i) { return bfast::ByteRange{ bytes.begin() + offsets[i]._begin, bytes.begin() + offsets[i]._end }; };
+        if (options.header) {
+            r.view.header = range(0);
+            r.stats.bytes_read += r.view.header.size();
+        }
+        r.view.attributes.reserve(selected.size());
+        for (auto i : selected) {
+            auto data = range(i);
+            r.mapping.prefetch(data);
+            r.stats.bytes_read += data.size();
+            r.view.attributes.emplace_back(r.descriptors[i - 2], (void*)data.begin(), (void*)data.end());
+        }
+        r.view.build_index();
+        r.stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return r;
+    }
+}
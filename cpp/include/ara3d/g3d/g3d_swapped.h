@@ -0,0 +1,96 @@
+/*
+    G3D Files of Either Byte Order
+    Copyright 2018, Ara 3D, Inc.
+    Usage licensed under terms of MIT License
+
+    Reads G3D files written on machines with the opposite byte order, such as big-endian capture rigs. The data types
+    in the attribute descriptors give the size of the values in each array, which is what SwappedBfast needs to
+    convert them. Files in native byte order are read without any conversion or copying.
+*/
+#pragma once
+
+#include "g3d.h"
+
+#include "../bfast/bfast_endian.h"
+
+namespace g3d
+{
+    /// Returns the size of the values in each array of a G3D BFAST: the meta-data string, the attribute descriptors,
+    /// then one array per attribute.
+    inline vector<size_t> bfast_value_sizes(const vector<AttributeDescriptor>& descriptors) {
+        vector<size_t> r = { 1, sizeof(int32_t) };
+        for (auto& desc : descriptors)
+            r.push_back(desc.data_type_size());
+        return r;
+    }
+
+    // A memory mapped G3D that can be read whatever byte order it was written in. The header, offsets and attribute
+    // descriptors are converted when the file is opened. Each attribute is converted the first time it is accessed,
+    // with SIMD byte shuffles, and attributes that are never accessed are never converted.
+    struct SwappedG3d
+    {
+        static const size_t npos = (size_t)-1;
+
+        bfast::SwappedBfast file;
+        vector<AttributeDescriptor> descriptors;
+
+        SwappedG3d() { }
+        explicit SwappedG3d(const string& path) { open(path); }
+
+        void open(const string& path) {
+            file.open(path);
+            if (file.num_arrays() < 2) throw runtime_error("Expected at least two arrays in a G3D: the header and the attribute descriptors");
+            // The descriptors are all 32-bit integers
+            file.set_value_size(1, sizeof(int32_t));
+            auto table = file[1];
+            auto n = file.num_arrays() - 2;
+            if (table.size() != n * sizeof(AttributeDescriptor)) throw runtime_error("Expected one attribute descriptor for each attribute array");
+            descriptors.resize(n);
+            if (n > 0)
+                memcpy(descriptors.data(), table.begin(), table.size());
+            for (size_t i = 0; i < n; ++i) {
+                auto& desc = descriptors[i];
+                desc.validate();
+                if (file.raw(i + 2).size() % (desc.data_type_size() * (size_t)desc.data_arity()) != 0)
+                    throw runtime_error("Size of attribute " + std::to_string(i) + " is not a multiple of its element size");
+            }
+            file.set_value_sizes(bfast_value_sizes(descriptors));
+        }
+
+        // True if the file was written with the opposite byte order
+        bool swapped() const { return file.swapped; }
+
+        size_t num_attributes() const { return descriptors.size(); }
+
+        string header_string() const {
+            auto r = file.raw(0);
+            return string((const char*)r.begin(), r.size());
+        }
+
+        // Returns the index of the attribute with the given descriptor, or npos if there is none
+        size_t find(const AttributeDescriptor& desc) const {
+            for (size_t i = 0; i < descriptors.size(); ++i)
+                if (descriptors[i] == desc)
+                    return i;
+            return npos;
+        }
+
+        // Returns an attribute in native byte order, converting it on first access. Safe to call concurrently.
+        Attribute attribute(size_t i) {
+            auto data = file[i + 2];
+            // Attributes hold non-const pointers, but nothing is written through them
+            return Attribute(descriptors.at(i), (void*)data.begin(), (void*)data.end());
+        }
+
+        // Converts every attribute and returns a view of them. The view must not outlive this object.
+        G3dView view() {
+            G3dView r;
+            r.header = file.raw(0);
+            r.attributes.reserve(descriptors.size());
+            for (size_t i = 0; i < descriptors.size(); ++i)
+                r.attributes.push_back(attribute(i));
+            r.build_index();
+            return r;
+        }
+    };
+}